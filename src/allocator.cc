@@ -1,124 +1,1977 @@
 #include "allocator.h"
 
+#include <fcntl.h>
+#include <unistd.h>
+
 #include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <random>
+#include <stdexcept>
+#include <system_error>
+
+#include "extent_cursor.h"
+#include "free_extent_mirror.h"
+#include "id_bitmap.h"
+#include "packed_extents.h"
+
+// Name of the database
+static const char *database_name = "AllocatorExtents";
+// Name of the database in the layout keyed by FreeIdExtent
+static const char *legacy_database_name = "Allocator";
+// Name of the database of free extents ordered by length
+static const char *size_database_name = "AllocatorSize";
+// Name of the database of packed free extents
+static const char *packed_database_name = "AllocatorPackedExtents";
+// Name of the database of the longest extent of every block of packed extents
+static const char *packed_size_database_name = "AllocatorPackedSize";
+// Name of the database of allocator metadata
+static const char *meta_database_name = "AllocatorMeta";
+// Name of the database of region bitmaps
+static const char *bitmap_database_name = "AllocatorBitmap";
+// Name of the database of deferred frees
+static const char *free_log_database_name = "AllocatorFreeLog";
+// Name of the database of free blocks of the buddy backend
+static const char *buddy_database_name = "AllocatorBuddy";
+// Name of the database of the leases of IdLeaseCache
+static const char *lease_database_name = "AllocatorLease";
+
+// Metadata key of the generation of the free extents
+static const char *generation_key = "generation";
+// Metadata key of the statistics of the free IDs
+static const char *stats_key = "stats";
+// Metadata key of the width of the IDs in bytes
+static const char *id_width_key = "id_width";
+// Metadata key of the rotor of next fit
+static const char *rotor_key = "rotor";
+// Metadata key of the last free extent while it is kept out of the database
+static const char *tail_key = "tail";
+// Metadata key of the sequence number of the next entry of the free log
+static const char *log_sequence_key = "log_sequence";
+// Metadata key of the range of IDs the allocator was created with
+static const char *range_key = "range";
+
+// Number of IDs in a region of the bitmap backend
+static constexpr uint64_t region_length = IdBitmap::bits;
+
+//
+// Number of valid IDs in #region
+//
+// Only the last region is short, as no ID may reach the largest ID.
+//
+template <typename Id> static inline Id RegionLength(Id region) {
+  return std::min<Id>(region_length,
+                      IdTraits<Id>::Max() - region * region_length);
+}
+
+//
+// Key of a free block in the database of the buddy backend
+//
+// The order of the block and then its starting ID are stored big-endian, so
+// that the free list of every order is a run of keys sorted by ID, and the
+// lists are sorted by order.
+//
+template <typename Id> struct BuddyKey {
+  static constexpr int width = sizeof(Id);
+
+  BuddyKey(unsigned int order, Id id) {
+    bytes[0] = order;
+    for (int i = 0; i < width; ++i)
+      bytes[1 + i] = id >> (8 * (width - 1 - i));
+  }
+
+  // Decode the order of the block from the key #key
+  static unsigned int Order(const lmdb::val &key) {
+    return key.data<const unsigned char>()[0];
+  }
+
+  // Decode the block from the key #key
+  static BasicFreeIdExtent<Id> Block(const lmdb::val &key) {
+    const unsigned char *bytes = key.data<const unsigned char>();
+    BasicFreeIdExtent<Id> block{0, Id(1) << bytes[0]};
+    for (int i = 0; i < width; ++i)
+      block.id = block.id << 8 | bytes[1 + i];
+    return block;
+  }
+
+  lmdb::val val() const { return lmdb::val(bytes, sizeof(bytes)); }
+
+  unsigned char bytes[1 + width];
+};
+
+//
+// Get the order of the smallest block holding #len IDs
+//
+template <typename Id> static inline unsigned int BuddyOrder(Id len) {
+  return len > 1 ? IdTraits<Id>::Log2(len - 1) + 1 : 0;
+}
+
+//
+// Append the #len IDs starting at #id to #runs, sorted by ID, merging them into
+// the last run if they follow it
+//
+template <typename Id>
+static inline void AppendRun(std::vector<basic_id_extent_t<Id>> &runs, Id id,
+                             Id len) {
+  if (!runs.empty() && runs.back().first + runs.back().second == id)
+    runs.back().second += len;
+  else
+    runs.push_back({id, len});
+}
+
+//
+// Check if #ext holds #id
+//
+template <typename Id>
+static inline bool AllocatorCheckExtentHolds(const BasicFreeIdExtent<Id> &ext,
+                                             Id id) {
+  return ext.id <= id && id - ext.id < ext.length;
+}
+
+//
+// Free Extent Comparator of the layout keyed by FreeIdExtent
+//
+static int AllocatorCompare(const MDB_val *a, const MDB_val *b) {
+  FreeIdExtent *a_ext = static_cast<FreeIdExtent *>(a->mv_data);
+  FreeIdExtent *b_ext = static_cast<FreeIdExtent *>(b->mv_data);
+  assert(a->mv_size == b->mv_size && a->mv_size == sizeof(FreeIdExtent));
+
+  if (a_ext->id != b_ext->id)
+    return (a_ext->id < b_ext->id) ? -1 : 1;
+  return 0;
+}
+
+//
+// Cursor over the free extent database
+//
+// The database is keyed by the last ID of an extent, see ExtentKey(), so the
+// first extent ending at or after an ID either holds it or follows it.
+//
+template <typename Id> struct DbExtentCursor : ExtentCursor<Id> {
+  typedef BasicFreeIdExtent<Id> FreeIdExtent;
+
+  DbExtentCursor(lmdb::txn &txn, lmdb::dbi &dbi)
+      : cursor(lmdb::cursor::open(txn, dbi)) {}
+
+  bool First(FreeIdExtent &ext) override { return Get(ext, MDB_FIRST); }
+  bool Last(FreeIdExtent &ext) override { return Get(ext, MDB_LAST); }
+  bool Next(FreeIdExtent &ext) override { return Get(ext, MDB_NEXT); }
+  bool Prev(FreeIdExtent &ext) override { return Get(ext, MDB_PREV); }
+  bool Seek(Id id, FreeIdExtent &ext) override {
+    return Get(ext, MDB_SET_RANGE, id) && ext.id == id;
+  }
+  bool SeekRange(Id id, FreeIdExtent &ext) override {
+    if (!Get(ext, MDB_SET_RANGE, id))
+      return false;
+    return ext.id >= id || Next(ext);
+  }
+  bool SeekEnd(Id id, FreeIdExtent &ext) override {
+    return Get(ext, MDB_SET_RANGE, id);
+  }
+  void Erase() override { cursor.del(); }
+  void Insert(const FreeIdExtent &ext) override {
+    IdKey<Id> last_id(ExtentKey(ext)), length(ext.length);
+    cursor.put(last_id.val(), length.val());
+  }
+  void Replace(const FreeIdExtent &old, const FreeIdExtent &ext) override {
+    if (ExtentKey(old) != ExtentKey(ext)) {
+      cursor.del();
+      Insert(ext);
+      return;
+    }
+    IdKey<Id> last_id(ExtentKey(ext)), length(ext.length);
+    cursor.put(last_id.val(), length.val(), MDB_CURRENT);
+  }
+
+private:
+  bool Get(FreeIdExtent &ext, MDB_cursor_op op, Id id = 0) {
+    IdKey<Id> last_id(id);
+    lmdb::val key = last_id.val(), data;
+    if (!cursor.get(key, data, op))
+      return false;
+    ext.length = IdKey<Id>::Get(data);
+    ext.id = IdKey<Id>::Get(key) - ext.length + 1;
+    return true;
+  }
+
+  lmdb::cursor cursor;
+};
+
+//
+// Open the database #name if it exists
+//
+static bool OpenIfExists(lmdb::txn &txn, const char *name, unsigned int flags,
+                         lmdb::dbi &dbi) {
+  try {
+    dbi = lmdb::dbi::open(txn, name, flags);
+    return true;
+  } catch (lmdb::not_found_error &) {
+    return false;
+  }
+}
+
+//
+// Read the generation of the free extents
+//
+static FreeExtentGeneration ReadGeneration(lmdb::txn &txn,
+                                           lmdb::dbi &meta_dbi) {
+  FreeExtentGeneration generation{0, 0};
+  lmdb::val key(generation_key, std::strlen(generation_key)), data;
+  if (meta_dbi.get(txn, key, data))
+    generation = *data.data<FreeExtentGeneration>();
+  return generation;
+}
+
+//
+// Read the rotor of next fit
+//
+// The rotor starts at the first ID.
+//
+template <typename Id>
+static Id ReadRotor(lmdb::txn &txn, lmdb::dbi &meta_dbi) {
+  Id rotor = 0;
+  lmdb::val key(rotor_key, std::strlen(rotor_key)), data;
+  if (meta_dbi.get(txn, key, data))
+    rotor = IdKey<Id>::Get(data);
+  return rotor;
+}
+
+//
+// Read the last free extent kept out of the free extent database
+//
+// There is no such tail if false is returned.
+//
+template <typename Id>
+static bool ReadTail(lmdb::txn &txn, lmdb::dbi &meta_dbi,
+                     BasicFreeIdExtent<Id> &tail) {
+  lmdb::val key(tail_key, std::strlen(tail_key)), data;
+  if (!meta_dbi.get(txn, key, data))
+    return false;
+  std::memcpy(&tail, data.data(), sizeof(BasicFreeIdExtent<Id>));
+  return true;
+}
+
+//
+// Write the tail, removing it if none of its IDs is left
+//
+template <typename Id>
+static void WriteTail(lmdb::txn &txn, lmdb::dbi &meta_dbi,
+                      const BasicFreeIdExtent<Id> &tail) {
+  lmdb::val key(tail_key, std::strlen(tail_key));
+  if (!tail.length) {
+    meta_dbi.del(txn, key);
+    return;
+  }
+  lmdb::val data(&tail, sizeof(BasicFreeIdExtent<Id>));
+  meta_dbi.put(txn, key, data);
+}
+
+//
+// Read the range of IDs the allocator was created with
+//
+// Allocators created before the range was recorded have none.
+//
+template <typename Id>
+static bool ReadRange(lmdb::txn &txn, lmdb::dbi &meta_dbi,
+                      BasicFreeIdExtent<Id> &range) {
+  lmdb::val key(range_key, std::strlen(range_key)), data;
+  if (!meta_dbi.get(txn, key, data))
+    return false;
+  std::memcpy(&range, data.data(), sizeof(BasicFreeIdExtent<Id>));
+  return true;
+}
+
+//
+// Record the range of IDs the allocator was created with
+//
+template <typename Id>
+static void WriteRange(lmdb::txn &txn, lmdb::dbi &meta_dbi,
+                       const BasicFreeIdExtent<Id> &range) {
+  lmdb::val key(range_key, std::strlen(range_key));
+  lmdb::val data(&range, sizeof(BasicFreeIdExtent<Id>));
+  meta_dbi.put(txn, key, data);
+}
+
+//
+// Read the sequence number of the next entry of the free log
+//
+// The number is kept in the metadata so it keeps growing when the log is
+// emptied by compaction. Databases that predate it go on from the last entry.
+//
+static uint64_t ReadLogSequence(lmdb::txn &txn, lmdb::dbi &meta_dbi,
+                                lmdb::dbi &free_log_dbi) {
+  uint64_t seq = 0;
+  lmdb::val key(log_sequence_key, std::strlen(log_sequence_key)), data;
+  if (meta_dbi.get(txn, key, data)) {
+    std::memcpy(&seq, data.data(), sizeof(uint64_t));
+    return seq;
+  }
+  lmdb::val log_key;
+  lmdb::cursor cursor = lmdb::cursor::open(txn, free_log_dbi);
+  if (cursor.get(log_key, data, MDB_LAST))
+    seq = *log_key.data<uint64_t>() + 1;
+  return seq;
+}
+
+//
+// Append the runs of free IDs of every bitmap to #runs, in order of ID
+//
+template <typename Id>
+static void ReadBitmapRuns(lmdb::txn &txn, lmdb::dbi &bitmap_dbi,
+                           std::vector<BasicFreeIdExtent<Id>> &runs) {
+  std::unique_ptr<IdBitmap> bitmap(new IdBitmap);
+  lmdb::val key, data;
+  lmdb::cursor cursor = lmdb::cursor::open(txn, bitmap_dbi);
+  for (bool found = cursor.get(key, data, MDB_FIRST); found;
+       found = cursor.get(key, data, MDB_NEXT)) {
+    Id start = IdKey<Id>::Get(key) * region_length;
+    std::memcpy(bitmap.get(), data.data(), sizeof(IdBitmap));
+    uint64_t bit, end = 0;
+    while (end < IdBitmap::bits && bitmap->FindFree(end, bit)) {
+      for (end = bit + 1; end < IdBitmap::bits && bitmap->IsFree(end); ++end)
+        ;
+      runs.push_back(BasicFreeIdExtent<Id>{Id(start + bit), Id(end - bit)});
+    }
+  }
+}
+
+//
+// Read the statistics of the free IDs
+//
+template <typename Id>
+static bool ReadStats(lmdb::txn &txn, lmdb::dbi &meta_dbi,
+                      BasicAllocatorStats<Id> &stats) {
+  lmdb::val key(stats_key, std::strlen(stats_key)), data;
+  if (!meta_dbi.get(txn, key, data))
+    return false;
+  std::memcpy(&stats, data.data(), sizeof(BasicAllocatorStats<Id>));
+  return true;
+}
+
+//
+// Account for the free extent #ext being added to or removed from #stats
+//
+template <typename Id>
+static inline void AddExtentStats(BasicAllocatorStats<Id> &stats,
+                                  const BasicFreeIdExtent<Id> &ext) {
+  stats.free_ids += ext.length;
+  ++stats.extents;
+  ++stats.histogram[IdTraits<Id>::Log2(ext.length)];
+}
+
+template <typename Id>
+static inline void RemoveExtentStats(BasicAllocatorStats<Id> &stats,
+                                     const BasicFreeIdExtent<Id> &ext) {
+  stats.free_ids -= ext.length;
+  --stats.extents;
+  --stats.histogram[IdTraits<Id>::Log2(ext.length)];
+}
+
+//
+// Open/create the allocator in the environment
+//
+// The free extents ordered by length are kept in a database of their own, which
+// is built from the free extent database if it does not exist yet.
+//
+// A new allocator starts with the range of IDs in #options free, and records
+// the range in its metadata. The free extents of an allocator in the layout
+// keyed by FreeIdExtent must be migrated first, see Migrate().
+//
+// The free extents are converted to or from packed blocks if they are not in
+// the format of #options. Either way, the extents are read in order, so they
+// are appended to the new databases.
+//
+// With the buddy backend, the free extents and the tail, if any, are freed as
+// blocks. With another backend, any free blocks are freed as extents. With a
+// backend other than bitmaps, the runs of free IDs of any bitmaps are freed as
+// extents or blocks.
+//
+// The width of the IDs is recorded in the metadata of a new allocator, and an
+// environment of another width is refused. Environments written before the
+// width was recorded have 64-bit IDs.
+//
+// The statistics of the free IDs are counted once if there are none yet, and
+// kept up to date by every update from then on.
+//
+template <typename Id>
+BasicAllocator<Id>::BasicAllocator(lmdb::env &env,
+                                   const AllocatorOptions &options) try
+    : dbi(0),
+      size_dbi(0),
+      meta_dbi(0),
+      bitmap_dbi(0),
+      free_log_dbi(0),
+      buddy_dbi(0),
+      policy(options.policy),
+      backend(options.backend),
+      deferred_free(options.deferred_free),
+      packed(options.packed_extents),
+      bump_tail(options.bump_tail),
+      writer(0),
+      generation(0),
+      stats(),
+      rotor(0),
+      updated(false) {
+  if (packed && options.mirror)
+    throw std::invalid_argument("packed extents cannot be mirrored");
+  if (bump_tail && backend != AllocatorBackend::Extent)
+    throw std::invalid_argument("only the extent backend can bump the tail");
+  if (backend == AllocatorBackend::Buddy && (packed || options.mirror))
+    throw std::invalid_argument("the buddy backend has no extents to pack or "
+                                "mirror");
+  if (options.id_count > IdTraits<Id>::Max() - options.first_id)
+    throw std::invalid_argument("the range of IDs goes past the largest ID");
+  lmdb::txn txn = lmdb::txn::begin(env);
+  try {
+    lmdb::dbi::open(txn, legacy_database_name, 0);
+    throw std::runtime_error("allocator database must be migrated first");
+  } catch (lmdb::not_found_error &) {
+  }
+  meta_dbi = lmdb::dbi::open(txn, meta_database_name, MDB_CREATE);
+  uint32_t width = sizeof(Id);
+  lmdb::val width_key(id_width_key, std::strlen(id_width_key)), width_data;
+  bool has_width = meta_dbi.get(txn, width_key, width_data);
+  if (has_width && *width_data.data<uint32_t>() != width)
+    throw std::runtime_error("allocator database has IDs of another width");
+  lmdb::dbi packed_dbi(0), packed_size_dbi(0);
+  bool has_extents =
+      OpenIfExists(txn, database_name, IdTraits<Id>::KeyFlags(), dbi);
+  bool has_packed = OpenIfExists(txn, packed_database_name,
+                                 IdTraits<Id>::KeyFlags(), packed_dbi);
+  // The width was not recorded before there were other widths than 64 bits
+  if (has_extents && !has_width && width != sizeof(uint64_t))
+    throw std::runtime_error("allocator database has IDs of another width");
+  if (!has_width) {
+    width_data = lmdb::val(&width, sizeof(uint32_t));
+    meta_dbi.put(txn, width_key, width_data);
+  }
+
+  FreeIdExtent initial{options.first_id, options.id_count};
+  if (!has_extents && !has_packed)
+    WriteRange(txn, meta_dbi, initial);
+  bool converted = false;
+  if (packed) {
+    if (has_packed) {
+      packed_size_dbi = lmdb::dbi::open(txn, packed_size_database_name, 0);
+    } else {
+      packed_dbi = lmdb::dbi::open(txn, packed_database_name,
+                                   MDB_CREATE | IdTraits<Id>::KeyFlags());
+      packed_size_dbi =
+          lmdb::dbi::open(txn, packed_size_database_name, MDB_CREATE);
+      if (has_extents) {
+        {
+          DbExtentCursor<Id> from(txn, dbi);
+          PackedExtentCursor<Id>::Pack(txn, packed_dbi, packed_size_dbi,
+                                       from);
+        }
+        dbi.drop(txn, true);
+        if (OpenIfExists(txn, size_database_name, 0, size_dbi))
+          size_dbi.drop(txn, true);
+        converted = true;
+      } else {
+        PackedExtentCursor<Id> cursor(txn, packed_dbi, packed_size_dbi);
+        cursor.Insert(initial);
+      }
+    }
+    dbi = std::move(packed_dbi);
+    size_dbi = std::move(packed_size_dbi);
+  } else {
+    if (!has_extents) {
+      dbi = lmdb::dbi::open(txn, database_name,
+                            MDB_CREATE | IdTraits<Id>::KeyFlags());
+      if (has_packed) {
+        packed_size_dbi = lmdb::dbi::open(txn, packed_size_database_name, 0);
+        {
+          PackedExtentCursor<Id> from(txn, packed_dbi, packed_size_dbi);
+          FreeIdExtent ext;
+          for (bool found = from.First(ext); found; found = from.Next(ext)) {
+            IdKey<Id> last_id(ExtentKey(ext)), length(ext.length);
+            lmdb::val key = last_id.val(), data = length.val();
+            dbi.put(txn, key, data, MDB_APPEND);
+          }
+        }
+        packed_dbi.drop(txn, true);
+        packed_size_dbi.drop(txn, true);
+        converted = true;
+      } else {
+        IdKey<Id> last_id(ExtentKey(initial)), length(initial.length);
+        lmdb::val key = last_id.val(), data = length.val();
+        dbi.put(txn, key, data);
+      }
+    }
+    if (!OpenIfExists(txn, size_database_name, 0, size_dbi)) {
+      size_dbi = lmdb::dbi::open(txn, size_database_name, MDB_CREATE);
+      FreeIdExtent ext;
+      lmdb::val data;
+      DbExtentCursor<Id> cursor(txn, dbi);
+      for (bool found = cursor.First(ext); found; found = cursor.Next(ext)) {
+        SizeKey<Id> size_key(ext);
+        lmdb::val key = size_key.val();
+        size_dbi.put(txn, key, data);
+      }
+    }
+  }
+  bitmap_dbi = lmdb::dbi::open(txn, bitmap_database_name,
+                               MDB_CREATE | IdTraits<Id>::KeyFlags());
+  free_log_dbi = lmdb::dbi::open(txn, free_log_database_name,
+                                 MDB_CREATE | MDB_INTEGERKEY);
+  buddy_dbi = lmdb::dbi::open(txn, buddy_database_name, MDB_CREATE);
+
+  bool recount = !ReadStats(txn, meta_dbi, stats);
+  if (backend == AllocatorBackend::Buddy) {
+    FreeIdExtent ext;
+    bool found;
+    {
+      DbExtentCursor<Id> cursor(txn, dbi);
+      for (found = cursor.First(ext); found; found = cursor.Next(ext))
+        BuddyFree(txn, ext.id, ext.length);
+      found = cursor.First(ext);
+    }
+    if (ReadTail(txn, meta_dbi, ext)) {
+      BuddyFree(txn, ext.id, ext.length);
+      WriteTail(txn, meta_dbi, FreeIdExtent{ext.id, 0});
+      found = true;
+    }
+    if (found) {
+      dbi.drop(txn);
+      size_dbi.drop(txn);
+      recount = true;
+    }
+  } else {
+    lmdb::val key, data;
+    lmdb::cursor cursor = lmdb::cursor::open(txn, buddy_dbi);
+    bool found = cursor.get(key, data, MDB_FIRST);
+    if (found) {
+      for (; found; found = cursor.get(key, data, MDB_NEXT)) {
+        FreeIdExtent block = BuddyKey<Id>::Block(key);
+        if (backend == AllocatorBackend::Bitmap)
+          FreeRun(txn, block.id, block.length);
+        else
+          FreeExtent(txn, block.id, block.length);
+      }
+      cursor.close();
+      buddy_dbi.drop(txn);
+      recount = true;
+    }
+  }
+  if (backend != AllocatorBackend::Bitmap) {
+    std::vector<FreeIdExtent> runs;
+    ReadBitmapRuns(txn, bitmap_dbi, runs);
+    lmdb::val key, data;
+    lmdb::cursor cursor = lmdb::cursor::open(txn, bitmap_dbi);
+    if (cursor.get(key, data, MDB_FIRST)) {
+      cursor.close();
+      bitmap_dbi.drop(txn);
+      for (const FreeIdExtent &run : runs) {
+        if (backend == AllocatorBackend::Buddy)
+          BuddyFree(txn, run.id, run.length);
+        else
+          FreeExtent(txn, run.id, run.length);
+      }
+      recount = true;
+    }
+  }
+
+  std::random_device random;
+  writer = (uint64_t)random() << 32 | random();
+  if (recount) {
+    FreeIdExtent ext;
+    stats = AllocatorStats();
+    std::unique_ptr<ExtentCursor<Id>> cursor = OpenDbCursor(txn);
+    for (bool found = cursor->First(ext); found; found = cursor->Next(ext))
+      AddExtentStats(stats, ext);
+    lmdb::val key, data;
+    lmdb::cursor buddy_cursor = lmdb::cursor::open(txn, buddy_dbi);
+    for (bool found = buddy_cursor.get(key, data, MDB_FIRST); found;
+         found = buddy_cursor.get(key, data, MDB_NEXT))
+      AddExtentStats(stats, BuddyKey<Id>::Block(key));
+    buddy_cursor.close();
+    lmdb::cursor bitmap_cursor = lmdb::cursor::open(txn, bitmap_dbi);
+    for (bool found = bitmap_cursor.get(key, data, MDB_FIRST); found;
+         found = bitmap_cursor.get(key, data, MDB_NEXT)) {
+      IdBitmap bitmap;
+      std::memcpy(&bitmap, data.data(), sizeof(IdBitmap));
+      stats.free_ids += bitmap.free_count;
+      ++stats.bitmaps;
+    }
+    bitmap_cursor.close();
+    generation = ReadGeneration(txn, meta_dbi).generation;
+    updated = true;
+    EndUpdate(txn);
+  } else if (converted) {
+    // A new generation makes the mirrors of other instances load again
+    generation = ReadGeneration(txn, meta_dbi).generation;
+    updated = true;
+    EndUpdate(txn);
+  }
+  if (options.mirror) {
+    DbExtentCursor<Id> cursor(txn, dbi);
+    mirror.reset(new FreeExtentMirror<Id>);
+    mirror->Load(cursor, ReadGeneration(txn, meta_dbi));
+  }
+  txn.commit();
+} catch (const lmdb::error &e) {
+  std::cout << e.what();
+  throw;
+}
+
+template <typename Id> BasicAllocator<Id>::~BasicAllocator() noexcept {}
+
+//
+// Migrate the free extents in the environment to the current layout
+//
+// Up to now the free extents were keyed by FreeIdExtent, ordered by the
+// comparator of the allocator. They are copied in order into the database keyed
+// by last ID, which the extents being disjoint keeps in order, so every extent
+// is appended. The database of free extents ordered by length is dropped, to be
+// built again in the new layout when the allocator is next opened.
+//
+// The legacy layout only ever held 64-bit IDs, so it is migrated to the layout
+// of 64-bit IDs whatever the width of the allocator.
+//
+template <typename Id>
+bool BasicAllocator<Id>::Migrate(lmdb::env &env) {
+  lmdb::txn txn = lmdb::txn::begin(env);
+  lmdb::dbi legacy_dbi(0);
+  try {
+    legacy_dbi = lmdb::dbi::open(txn, legacy_database_name, 0);
+  } catch (lmdb::not_found_error &) {
+    return false;
+  }
+  legacy_dbi.set_compare(txn, AllocatorCompare);
+
+  lmdb::dbi dbi =
+      lmdb::dbi::open(txn, database_name, MDB_CREATE | MDB_INTEGERKEY);
+  dbi.drop(txn);
+  lmdb::val key, data;
+  lmdb::cursor cursor = lmdb::cursor::open(txn, legacy_dbi);
+  for (bool found = cursor.get(key, data, MDB_FIRST); found;
+       found = cursor.get(key, data, MDB_NEXT)) {
+    BasicFreeIdExtent<uint64_t> ext = *key.data<BasicFreeIdExtent<uint64_t>>();
+    uint64_t last_id = ExtentKey(ext);
+    lmdb::val new_key(&last_id, sizeof(uint64_t));
+    lmdb::val new_data(&ext.length, sizeof(uint64_t));
+    dbi.put(txn, new_key, new_data, MDB_APPEND);
+  }
+  cursor.close();
+  legacy_dbi.drop(txn, true);
+
+  try {
+    lmdb::dbi size_dbi = lmdb::dbi::open(txn, size_database_name, 0);
+    size_dbi.drop(txn, true);
+  } catch (lmdb::not_found_error &) {
+  }
+  txn.commit();
+  return true;
+}
+
+//
+// Rebuild the free IDs as the complement of the IDs keyed in #live_dbi and of
+// #live_ids
+//
+// The IDs keyed in #live_dbi are read in order with a single cursor and merged
+// with #live_ids, once sorted. The gaps between the live IDs within the range
+// of IDs the allocator was created with are appended to the emptied free
+// extent database. Allocators created before the range was
+// recorded take it from #options, and record it.
+//
+// Every other database of free IDs is dropped, along with the statistics, the
+// rotor and the tail, so the next allocator opened builds them from the free
+// extents as for a new environment, in the layout of its options. A new
+// generation makes the mirrors of allocators in other processes load the free
+// extents again.
+//
+// The leases left behind by an IdLeaseCache are dropped too. Their IDs not in
+// use are free once rebuilt, so recovering the leases would free them twice.
+//
+// All of it happens in #txn, so the rebuilt free IDs replace the old ones
+// atomically when it is committed.
+//
+template <typename Id>
+uint64_t
+BasicAllocator<Id>::RebuildFromLiveIds(lmdb::txn &txn, lmdb::dbi &live_dbi,
+                                       std::vector<object_id_t> live_ids,
+                                       const AllocatorOptions &options) {
+  lmdb::dbi legacy_dbi(0);
+  if (OpenIfExists(txn, legacy_database_name, 0, legacy_dbi))
+    throw std::runtime_error("allocator database must be migrated first");
+  lmdb::dbi meta_dbi = lmdb::dbi::open(txn, meta_database_name, MDB_CREATE);
+  uint32_t width = sizeof(Id);
+  lmdb::val width_key(id_width_key, std::strlen(id_width_key)), width_data;
+  if (meta_dbi.get(txn, width_key, width_data) &&
+      *width_data.data<uint32_t>() != width)
+    throw std::runtime_error("allocator database has IDs of another width");
+  width_data = lmdb::val(&width, sizeof(uint32_t));
+  meta_dbi.put(txn, width_key, width_data);
+  FreeIdExtent range{options.first_id, options.id_count};
+  if (!ReadRange(txn, meta_dbi, range)) {
+    if (range.length > IdTraits<Id>::Max() - range.id)
+      throw std::invalid_argument("the range of IDs goes past the largest ID");
+    WriteRange(txn, meta_dbi, range);
+  }
+
+  const char *dropped[] = {size_database_name,   packed_database_name,
+                           packed_size_database_name, bitmap_database_name,
+                           free_log_database_name, buddy_database_name,
+                           lease_database_name};
+  for (const char *name : dropped) {
+    lmdb::dbi other(0);
+    if (OpenIfExists(txn, name, 0, other))
+      other.drop(txn, true);
+  }
+  for (const char *name : {stats_key, rotor_key, tail_key}) {
+    lmdb::val key(name, std::strlen(name));
+    meta_dbi.del(txn, key);
+  }
+  FreeExtentGeneration next{ReadGeneration(txn, meta_dbi).generation + 1, 0};
+  lmdb::val generation_key_val(generation_key, std::strlen(generation_key));
+  lmdb::val generation_data(&next, sizeof(FreeExtentGeneration));
+  meta_dbi.put(txn, generation_key_val, generation_data);
+
+  lmdb::dbi dbi = lmdb::dbi::open(txn, database_name,
+                                  MDB_CREATE | IdTraits<Id>::KeyFlags());
+  dbi.drop(txn);
+  uint64_t extents = 0;
+  auto append = [&](Id start, Id len) {
+    IdKey<Id> last_id(start + len - 1), length(len);
+    lmdb::val key = last_id.val(), data = length.val();
+    dbi.put(txn, key, data, MDB_APPEND);
+    ++extents;
+  };
+
+  Id id = range.id, end = range.id + range.length;
+  std::sort(live_ids.begin(), live_ids.end());
+  auto live_id_it = std::lower_bound(live_ids.begin(), live_ids.end(), id);
+  IdKey<Id> first(id);
+  lmdb::val key = first.val(), data;
+  lmdb::cursor cursor = lmdb::cursor::open(txn, live_dbi);
+  bool found = cursor.get(key, data, MDB_SET_RANGE);
+  while (found || live_id_it != live_ids.end()) {
+    Id live_id;
+    if (found && (live_id_it == live_ids.end() ||
+                  IdKey<Id>::Get(key) < *live_id_it)) {
+      live_id = IdKey<Id>::Get(key);
+      found = cursor.get(key, data, MDB_NEXT);
+    } else {
+      live_id = *live_id_it++;
+    }
+    if (live_id >= end)
+      break;
+    if (id < live_id)
+      append(id, live_id - id);
+    // An ID may be live in both
+    id = std::max<Id>(id, live_id + 1);
+  }
+  cursor.close();
+  if (id < end)
+    append(id, end - id);
+  return extents;
+}
+
+//
+// Prepare for changing the free extents in #txn
+//
+// The mirror, if any, is synced with the database first. Should it be unable to
+// catch up, e.g. because another allocator instance changed the free extents,
+// it is loaded again.
+//
+// A tail kept out of the free extent database is put back into it, whatever
+// the options of this instance, so that the free extents are complete for the
+// update. EndUpdate() takes it out again if it is still the only free extent.
+//
+template <typename Id>
+void BasicAllocator<Id>::BeginUpdate(lmdb::txn &txn) {
+  FreeExtentGeneration current = ReadGeneration(txn, meta_dbi);
+  if (mirror && !mirror->Sync(txn, current)) {
+    DbExtentCursor<Id> cursor(txn, dbi);
+    mirror->Load(cursor, current);
+    mirror->Sync(txn, current);
+  }
+  generation = current.generation;
+  ReadStats(txn, meta_dbi, stats);
+  if (policy == AllocationPolicy::NextFit)
+    rotor = ReadRotor<Id>(txn, meta_dbi);
+  updated = false;
+
+  FreeIdExtent tail;
+  if (ReadTail(txn, meta_dbi, tail)) {
+    std::unique_ptr<ExtentCursor<Id>> cursor = OpenCursor(txn);
+    InsertExtent(txn, *cursor, tail);
+    WriteTail(txn, meta_dbi, FreeIdExtent{tail.id, 0});
+    // The rotor is not moved by bumping the tail, but no ID is free before it
+    if (rotor < tail.id)
+      rotor = tail.id;
+  }
+}
+
+//
+// Finish changing the free extents in #txn
+//
+// A new generation is stored if the free extents were changed, along with the
+// statistics of the free IDs and, with next fit, the rotor. The longest extent
+// is looked up in the index by length then, as removing an extent gives no clue
+// of the next longest one.
+//
+// If the free extents were changed and only one is left, it becomes the tail.
+//
+template <typename Id>
+void BasicAllocator<Id>::EndUpdate(lmdb::txn &txn) {
+  if (!updated)
+    return;
+  if (bump_tail && stats.extents == 1)
+    StashTail(txn);
+  FreeExtentGeneration next{generation + 1, writer};
+  lmdb::val key(generation_key, std::strlen(generation_key));
+  lmdb::val data(&next, sizeof(FreeExtentGeneration));
+  meta_dbi.put(txn, key, data);
+
+  FreeIdExtent ext;
+  stats.largest_extent = FindLongest(txn, ext) ? ext.length : 0;
+  lmdb::val stats_key_val(stats_key, std::strlen(stats_key));
+  lmdb::val stats_data(&stats, sizeof(AllocatorStats));
+  meta_dbi.put(txn, stats_key_val, stats_data);
+  if (policy == AllocationPolicy::NextFit) {
+    IdKey<Id> rotor_id(rotor);
+    lmdb::val rotor_key_val(rotor_key, std::strlen(rotor_key));
+    lmdb::val rotor_data = rotor_id.val();
+    meta_dbi.put(txn, rotor_key_val, rotor_data);
+  }
+  if (mirror)
+    mirror->SetGeneration(next);
+  updated = false;
+}
+
+//
+// Open a cursor over the free extents
+//
+template <typename Id>
+std::unique_ptr<ExtentCursor<Id>>
+BasicAllocator<Id>::OpenCursor(lmdb::txn &txn) {
+  if (mirror)
+    return std::unique_ptr<ExtentCursor<Id>>(
+        new MirrorExtentCursor<Id>(*mirror, txn, dbi));
+  return OpenDbCursor(txn);
+}
+
+//
+// Open a cursor over the free extents in the database, bypassing the mirror
+//
+template <typename Id>
+std::unique_ptr<ExtentCursor<Id>>
+BasicAllocator<Id>::OpenDbCursor(lmdb::txn &txn) {
+  if (packed)
+    return std::unique_ptr<ExtentCursor<Id>>(
+        new PackedExtentCursor<Id>(txn, dbi, size_dbi));
+  return std::unique_ptr<ExtentCursor<Id>>(new DbExtentCursor<Id>(txn, dbi));
+}
+
+//
+// Allocate up to #len IDs from the tail kept out of the free extents
+//
+// While the last free extent is the only one, it is kept in the allocator
+// metadata rather than the free extent database. As no ID before it is free,
+// every allocation policy takes its first IDs, so allocating only moves its
+// start up: a single small value is written, and neither the free extents nor
+// their statistics change. Should there be no tail, false is returned.
+//
+template <typename Id>
+bool BasicAllocator<Id>::BumpTail(lmdb::txn &txn, object_id_t len,
+                                  id_extent_t &run) {
+  FreeIdExtent tail;
+  if (!ReadTail(txn, meta_dbi, tail))
+    return false;
+  object_id_t alloc_id_len = std::min(tail.length, len);
+  run = {tail.id, alloc_id_len};
+  WriteTail(txn, meta_dbi,
+            FreeIdExtent{tail.id + alloc_id_len, tail.length - alloc_id_len});
+  return true;
+}
+
+//
+// Move the last free extent out of the free extent database as the tail
+//
+// With next fit, the extent is left in the database if it holds the rotor past
+// its start, as allocating from the tail would skip the IDs before the rotor.
+//
+template <typename Id>
+void BasicAllocator<Id>::StashTail(lmdb::txn &txn) {
+  FreeIdExtent ext;
+  std::unique_ptr<ExtentCursor<Id>> cursor = OpenCursor(txn);
+  if (!cursor->Last(ext))
+    return;
+  if (policy == AllocationPolicy::NextFit && rotor != ext.id &&
+      AllocatorCheckExtentHolds(ext, rotor))
+    return;
+  EraseExtent(txn, *cursor, ext);
+  WriteTail(txn, meta_dbi, ext);
+}
+
+//
+// Take the #len IDs starting at #id out of the extent #ext at #cursor
+//
+// The IDs of #ext after the taken ones keep its last ID, so they replace #ext
+// in place, and the IDs before them are inserted as an extent of their own.
+//
+template <typename Id>
+void BasicAllocator<Id>::TakeExtent(lmdb::txn &txn, ExtentCursor<Id> &cursor,
+                                    const FreeIdExtent &ext, object_id_t id,
+                                    object_id_t len) {
+  if (!len)
+    return;
+  object_id_t end = id + len, ext_end = ext.id + ext.length;
+  FreeIdExtent head{ext.id, id - ext.id};
+  if (end < ext_end) {
+    ReplaceExtent(txn, cursor, ext, {end, ext_end - end});
+    if (head.length)
+      InsertExtent(txn, cursor, head);
+  } else if (head.length) {
+    ReplaceExtent(txn, cursor, ext, head);
+  } else {
+    EraseExtent(txn, cursor, ext);
+  }
+}
+
+//
+// Remove the extent #ext at #cursor from the free extent database
+//
+// Every removal goes through here so that the extents ordered by length stay in
+// sync with the free extent database. Packed extents keep the longest extent of
+// their blocks up to date themselves.
+//
+template <typename Id>
+void BasicAllocator<Id>::EraseExtent(lmdb::txn &txn, ExtentCursor<Id> &cursor,
+                                     const FreeIdExtent &ext) {
+  SizeKey<Id> size_key(ext);
+  cursor.Erase();
+  if (!packed)
+    size_dbi.del(txn, size_key.val());
+  RemoveExtentStats(stats, ext);
+  updated = true;
+}
+
+//
+// Insert the extent #ext into the free extent database
+//
+// #cursor is left at the inserted extent.
+//
+template <typename Id>
+void BasicAllocator<Id>::InsertExtent(lmdb::txn &txn, ExtentCursor<Id> &cursor,
+                                      const FreeIdExtent &ext) {
+  SizeKey<Id> size_key(ext);
+  lmdb::val key = size_key.val(), data;
+  cursor.Insert(ext);
+  if (!packed)
+    size_dbi.put(txn, key, data);
+  AddExtentStats(stats, ext);
+  updated = true;
+}
+
+//
+// Replace the extent #old at #cursor with #ext
+//
+// An extent keeping its last ID is updated in place in the free extent
+// database.
+//
+template <typename Id>
+void BasicAllocator<Id>::ReplaceExtent(lmdb::txn &txn, ExtentCursor<Id> &cursor,
+                                       const FreeIdExtent &old,
+                                       const FreeIdExtent &ext) {
+  SizeKey<Id> old_size_key(old), size_key(ext);
+  lmdb::val key = size_key.val(), data;
+  cursor.Replace(old, ext);
+  if (!packed) {
+    size_dbi.del(txn, old_size_key.val());
+    size_dbi.put(txn, key, data);
+  }
+  RemoveExtentStats(stats, old);
+  AddExtentStats(stats, ext);
+  updated = true;
+}
+
+//
+// Find the shortest extent holding at least #len IDs
+//
+// Among extents of the same length the one with the lowest ID is chosen.
+//
+template <typename Id>
+bool BasicAllocator<Id>::FindBestFit(lmdb::txn &txn, object_id_t len,
+                                     FreeIdExtent &ext) {
+  if (mirror)
+    return mirror->BestFit(len, ext);
+  if (packed)
+    return PackedExtentCursor<Id>::BestFit(txn, dbi, size_dbi, len, ext);
+
+  SizeKey<Id> size_key(FreeIdExtent{0, len});
+  lmdb::val key = size_key.val(), data;
+  lmdb::cursor cursor = lmdb::cursor::open(txn, size_dbi);
+  if (!cursor.get(key, data, MDB_SET_RANGE))
+    return false;
+  ext = SizeKey<Id>::Extent(key);
+  return true;
+}
+
+//
+// Find the longest extent
+//
+template <typename Id>
+bool BasicAllocator<Id>::FindLongest(lmdb::txn &txn, FreeIdExtent &ext) {
+  if (backend == AllocatorBackend::Buddy) {
+    lmdb::val key, data;
+    lmdb::cursor cursor = lmdb::cursor::open(txn, buddy_dbi);
+    if (!cursor.get(key, data, MDB_LAST))
+      return false;
+    ext = BuddyKey<Id>::Block(key);
+    return true;
+  }
+  if (mirror)
+    return mirror->Longest(ext);
+  if (packed)
+    return PackedExtentCursor<Id>::Longest(txn, dbi, size_dbi, ext);
+
+  lmdb::val key, data;
+  lmdb::cursor cursor = lmdb::cursor::open(txn, size_dbi);
+  if (!cursor.get(key, data, MDB_LAST))
+    return false;
+  ext = SizeKey<Id>::Extent(key);
+  return true;
+}
+
+//
+// Find the shortest extent holding #len IDs from a multiple of #align on
+//
+// The extents are tried by length from #len up. Every extent of at least
+// #len + #align - 1 IDs holds such a window, so only the extents shorter than
+// that can be passed over. Among extents of the same length the one with the
+// lowest ID is chosen.
+//
+template <typename Id>
+bool BasicAllocator<Id>::FindAlignedFit(lmdb::txn &txn, object_id_t len,
+                                        object_id_t align, FreeIdExtent &ext) {
+  if (mirror)
+    return mirror->AlignedFit(len, align, ext);
+
+  object_id_t id;
+  SizeKey<Id> size_key(FreeIdExtent{0, len});
+  lmdb::val key = size_key.val(), data;
+  lmdb::cursor cursor = lmdb::cursor::open(txn, size_dbi);
+  for (bool found = cursor.get(key, data, MDB_SET_RANGE); found;
+       found = cursor.get(key, data, MDB_NEXT)) {
+    ext = SizeKey<Id>::Extent(key);
+    if (AlignedWindow(ext, len, align, id))
+      return true;
+  }
+  return false;
+}
+
+//
+// Position #cursor at the extent to allocate #len IDs at #id, a multiple of
+// #align, from
+//
+// The request is turned down right away if even the longest extent is too
+// short. With best fit, the free extents ordered by length are searched, see
+// FindAlignedFit(). Otherwise the extents are walked by ID from the first one,
+// or from the rotor with next fit, and the first extent holding a window is
+// used. The index of packed extents only has the longest extent of a block, so
+// packed extents are always walked by ID.
+//
+template <typename Id>
+bool BasicAllocator<Id>::SeekAlignedExtent(lmdb::txn &txn,
+                                           ExtentCursor<Id> &cursor,
+                                           object_id_t len, object_id_t align,
+                                           FreeIdExtent &ext, object_id_t &id) {
+  if (!FindLongest(txn, ext) || ext.length < len)
+    return false;
+  if (policy == AllocationPolicy::BestFit && !packed)
+    return FindAlignedFit(txn, len, align, ext) && cursor.Seek(ext.id, ext) &&
+           AlignedWindow(ext, len, align, id);
+
+  bool next_fit = policy == AllocationPolicy::NextFit;
+  bool found = next_fit ? cursor.SeekEnd(rotor, ext) : cursor.First(ext);
+  for (bool wrapped = !next_fit;; found = cursor.Next(ext)) {
+    if (!found) {
+      if (wrapped || !cursor.First(ext))
+        return false;
+      wrapped = true;
+    }
+    // Next fit leaves the IDs before the rotor until it wraps around
+    FreeIdExtent window = ext;
+    if (!wrapped && AllocatorCheckExtentHolds(ext, rotor))
+      window = {rotor, ext.id + ext.length - rotor};
+    if (window.length >= len && AlignedWindow(window, len, align, id))
+      return true;
+  }
+}
+
+//
+// Position #cursor at the extent to allocate #len IDs from
+//
+// With best fit, if no extent is long enough the longest one is used, just as
+// first fit uses the first extent whatever its length.
+//
+// With next fit, the extent may hold the rotor, in which case it is to be
+// allocated from at the rotor.
+//
+template <typename Id>
+bool BasicAllocator<Id>::SeekExtent(lmdb::txn &txn, ExtentCursor<Id> &cursor,
+                                    object_id_t len, FreeIdExtent &ext) {
+  if (policy == AllocationPolicy::FirstFit)
+    return cursor.First(ext);
+  if (policy == AllocationPolicy::NextFit)
+    return cursor.SeekEnd(rotor, ext) || cursor.First(ext);
+
+  if (!FindBestFit(txn, len, ext) && !FindLongest(txn, ext))
+    return false;
+  return cursor.Seek(ext.id, ext);
+}
+
+//
+// Allocate an ID from the free extent database
+//
+// The extent is chosen according to the allocation policy, and the starting ID
+// of the found extent is returned to the caller. The allocation is truncated to
+// the length of the extent.
+//
+// With next fit, an extent holding the rotor is allocated from at the rotor,
+// leaving the IDs before it free until the rotor comes around again.
+//
+// If the tail is kept out of the free extents, no ID before it is free, so it
+// is bumped without going through the free extents at all.
+//
+// With the buddy backend, the smallest block holding #len IDs is split down to
+// the shortest power of two holding them, and the IDs past #len freed again.
+// If there is no such block, the largest one is used.
+//
+template <typename Id>
+optional<basic_id_extent_t<Id>>
+BasicAllocator<Id>::IdAllocate(lmdb::txn &txn, object_id_t len) {
+  id_extent_t run;
+  if (bump_tail && BumpTail(txn, len, run))
+    return run;
+
+  BeginUpdate(txn);
+  if (backend == AllocatorBackend::Buddy) {
+    optional<id_extent_t> run = BuddyAllocate(txn, len, BuddyOrder(len), true);
+    EndUpdate(txn);
+    return run;
+  }
+  if (backend == AllocatorBackend::Bitmap) {
+    optional<id_extent_t> run = AllocateRun(txn, len);
+    if (run)
+      rotor = run->first + run->second;
+    EndUpdate(txn);
+    return run;
+  }
+
+  FreeIdExtent ext;
+  std::unique_ptr<ExtentCursor<Id>> cursor = OpenCursor(txn);
+  if (!SeekExtent(txn, *cursor, len, ext)) {
+    EndUpdate(txn);
+    return {};
+  }
+
+  object_id_t alloc_id = ext.id;
+  if (policy == AllocationPolicy::NextFit &&
+      AllocatorCheckExtentHolds(ext, rotor))
+    alloc_id = rotor;
+  object_id_t alloc_id_len = std::min(ext.id + ext.length - alloc_id, len);
+  TakeExtent(txn, *cursor, ext, alloc_id, alloc_id_len);
+  rotor = alloc_id + alloc_id_len;
+  EndUpdate(txn);
+
+  return {{alloc_id, alloc_id_len}};
+}
+
+//
+// Allocate #len IDs starting at a multiple of #align
+//
+// The extent holding the IDs is split into up to three pieces: the free IDs
+// before the allocated ones, the allocated ones and the free IDs after them.
+// Unlike IdAllocate(), the allocation is never truncated. An #align of 0 is
+// taken as 1.
+//
+// With the bitmap backend, only wholly free regions are searched. The regions
+// covering the allocated IDs are taken whole, and their other IDs freed to
+// bitmaps.
+//
+// With the buddy backend, every block is aligned to its length, so the block
+// is taken from the order of #align up. #align must be a power of two then.
+//
+template <typename Id>
+optional<basic_id_extent_t<Id>>
+BasicAllocator<Id>::IdAllocateAligned(lmdb::txn &txn, object_id_t len,
+                                      object_id_t align) {
+  if (!align)
+    align = 1;
+  BeginUpdate(txn);
+  if (backend == AllocatorBackend::Buddy) {
+    optional<id_extent_t> run;
+    if (!(align & (align - 1)))
+      run = BuddyAllocate(txn, len,
+                          std::max(BuddyOrder(len), IdTraits<Id>::Log2(align)),
+                          false);
+    EndUpdate(txn);
+    return run;
+  }
+
+  FreeIdExtent ext;
+  object_id_t id;
+  std::unique_ptr<ExtentCursor<Id>> cursor = OpenCursor(txn);
+  if (!SeekAlignedExtent(txn, *cursor, len, align, ext, id)) {
+    EndUpdate(txn);
+    return {};
+  }
+
+  if (backend == AllocatorBackend::Bitmap) {
+    object_id_t start =
+        std::max<Id>(ext.id, id / region_length * region_length);
+    object_id_t end = id + len, room = ext.id + ext.length - end;
+    end += std::min<Id>(room, (region_length - end % region_length) %
+                                  region_length);
+    TakeExtent(txn, *cursor, ext, start, end - start);
+    cursor.reset();
+    if (start < id)
+      FreeRun(txn, start, id - start);
+    if (id + len < end)
+      FreeRun(txn, id + len, end - (id + len));
+  } else {
+    TakeExtent(txn, *cursor, ext, id, len);
+  }
+  rotor = id + len;
+  EndUpdate(txn);
+
+  return {{id, len}};
+}
+
+//
+// Allocate IDs from the last free extent, leaving the free IDs before it
+//
+// While the last free extent runs to the end of the range of IDs, the IDs are
+// past every allocated ID. The tail, if there is one, is the last free extent
+// and bumped right away. The allocation is truncated to the length of the
+// extent.
+//
+// With the buddy backend, the free block with the highest ID among those
+// holding #len IDs is used, or else the one with the highest ID. The last block
+// of every free list is looked up to find it.
+//
+template <typename Id>
+optional<basic_id_extent_t<Id>>
+BasicAllocator<Id>::IdAllocateFresh(lmdb::txn &txn, object_id_t len) {
+  id_extent_t run;
+  if (BumpTail(txn, len, run))
+    return run;
+
+  BeginUpdate(txn);
+  if (backend == AllocatorBackend::Buddy) {
+    FreeIdExtent block{0, 0}, fit{0, 0};
+    lmdb::val key, data;
+    lmdb::cursor cursor = lmdb::cursor::open(txn, buddy_dbi);
+    for (bool found = cursor.get(key, data, MDB_LAST); found;) {
+      FreeIdExtent last = BuddyKey<Id>::Block(key);
+      if (!block.length || last.id > block.id)
+        block = last;
+      if (last.length >= len && (!fit.length || last.id > fit.id))
+        fit = last;
+      // Move to the last block of the order below
+      BuddyKey<Id> list(BuddyKey<Id>::Order(key), 0);
+      key = list.val();
+      found = cursor.get(key, data, MDB_SET_RANGE) &&
+              cursor.get(key, data, MDB_PREV);
+    }
+    cursor.close();
+    if (fit.length)
+      block = fit;
+    optional<id_extent_t> result;
+    if (block.length && len)
+      result = TakeBlock(txn, block, BuddyOrder(std::min(len, block.length)),
+                         len);
+    EndUpdate(txn);
+    return result;
+  }
+
+  FreeIdExtent ext;
+  std::unique_ptr<ExtentCursor<Id>> cursor = OpenCursor(txn);
+  if (!cursor->Last(ext)) {
+    EndUpdate(txn);
+    return {};
+  }
+
+  optional<id_extent_t> result;
+  if (backend == AllocatorBackend::Extent) {
+    result = id_extent_t{ext.id, std::min(ext.length, len)};
+    TakeExtent(txn, *cursor, ext, result->first, result->second);
+  } else if (len) {
+    result = AllocateRunAt(txn, std::move(cursor), ext, ext.id, len);
+  }
+  if (result)
+    rotor = result->first + result->second;
+  EndUpdate(txn);
+  return result;
+}
+
+//
+// Allocate an ID as close to #hint as possible
+//
+// The free extent holding #hint is allocated from at #hint, leaving the IDs
+// before it free. Otherwise the closer of the extents around #hint is used,
+// from its end nearest to #hint, so related objects get IDs next to each other.
+// As with IdAllocate(), the allocation is truncated to the length of the
+// extent.
+//
+// With the bitmap backend, the bitmap of the region of #hint is tried first,
+// falling back to the allocation policy. The buddy backend allocates as
+// IdAllocate() does, whatever #hint.
+//
+template <typename Id>
+optional<basic_id_extent_t<Id>>
+BasicAllocator<Id>::IdAllocateNear(lmdb::txn &txn, object_id_t hint,
+                                   object_id_t len) {
+  if (backend == AllocatorBackend::Buddy)
+    return IdAllocate(txn, len);
+
+  BeginUpdate(txn);
+  if (backend == AllocatorBackend::Bitmap) {
+    optional<id_extent_t> run = AllocateNearInBitmap(txn, hint, len);
+    if (!run)
+      run = AllocateRun(txn, len);
+    EndUpdate(txn);
+    return run;
+  }
+
+  // #ext is the first extent after #hint, and #prev_ext the one before it,
+  // which may hold #hint
+  FreeIdExtent ext, prev_ext;
+  std::unique_ptr<ExtentCursor<Id>> cursor = OpenCursor(txn);
+  bool found = cursor->SeekRange(hint, ext);
+  bool found_prev = found ? cursor->Prev(prev_ext) : cursor->Last(prev_ext);
+  if (!found && !found_prev) {
+    EndUpdate(txn);
+    return {};
+  }
+
+  object_id_t alloc_id, alloc_id_len;
+  object_id_t prev_end = found_prev ? prev_ext.id + prev_ext.length : 0;
+  if (found_prev && prev_end > hint) {
+    alloc_id = hint;
+    alloc_id_len = std::min(len, prev_end - hint);
+    TakeExtent(txn, *cursor, prev_ext, alloc_id, alloc_id_len);
+  } else if (found && (!found_prev || ext.id - hint <= hint - prev_end)) {
+    if (found_prev)
+      cursor->Next(ext);
+    else
+      cursor->Seek(ext.id, ext);
+    alloc_id = ext.id;
+    alloc_id_len = std::min(len, ext.length);
+    TakeExtent(txn, *cursor, ext, alloc_id, alloc_id_len);
+  } else {
+    alloc_id_len = std::min(len, prev_ext.length);
+    alloc_id = prev_end - alloc_id_len;
+    TakeExtent(txn, *cursor, prev_ext, alloc_id, alloc_id_len);
+  }
+  EndUpdate(txn);
+
+  return {{alloc_id, alloc_id_len}};
+}
+
+//
+// Allocate exactly #len IDs from the free extent database
+//
+template <typename Id>
+optional<std::vector<basic_id_extent_t<Id>>>
+BasicAllocator<Id>::IdAllocateN(lmdb::txn &txn, object_id_t len) {
+  auto r = IdAllocateN(txn, std::vector<object_id_t>(1, len));
+  if (!r)
+    return {};
+  return std::move(r->front());
+}
+
+//
+// Allocate exactly #lens[i] IDs for every request i
+//
+// Unlike IdAllocate(), the requests are not truncated to the length of the
+// first extent. The free extents are walked in order with a single cursor until
+// they cover the sum of all requests, and only then consumed (walking the
+// cursor back), so running short leaves the database untouched. The collected
+// extents are handed to the requests in order.
+//
+// With best fit, the shortest extent holding the sum of all requests is used
+// instead if there is one.
+//
+// With the bitmap and buddy backends, runs are allocated one after another
+// until they cover the sum, and freed again if the IDs run out.
+//
+template <typename Id>
+optional<std::vector<std::vector<basic_id_extent_t<Id>>>>
+BasicAllocator<Id>::IdAllocateN(lmdb::txn &txn,
+                                const std::vector<object_id_t> &lens) {
+  object_id_t total = 0;
+  for (object_id_t len : lens) {
+    // No database could hold that many free IDs
+    if (total + len < total)
+      return {};
+    total += len;
+  }
+
+  BeginUpdate(txn);
+  std::vector<id_extent_t> allocated;
+  std::unique_ptr<ExtentCursor<Id>> cursor = OpenCursor(txn);
+  FreeIdExtent ext;
+  if (total && backend != AllocatorBackend::Extent) {
+    bool buddy = backend == AllocatorBackend::Buddy;
+    object_id_t found = 0;
+    while (found < total) {
+      object_id_t len = total - found;
+      optional<id_extent_t> run =
+          buddy ? BuddyAllocate(txn, len, BuddyOrder(len), true)
+                : AllocateRun(txn, len);
+      if (!run)
+        break;
+      allocated.push_back(*run);
+      found += run->second;
+      rotor = run->first + run->second;
+    }
+    if (found < total) {
+      for (const id_extent_t &run : allocated) {
+        if (buddy)
+          BuddyFree(txn, run.first, run.second);
+        else
+          FreeRun(txn, run.first, run.second);
+      }
+      EndUpdate(txn);
+      return {};
+    }
+  } else if (total && policy == AllocationPolicy::BestFit &&
+             FindBestFit(txn, total, ext)) {
+    cursor->Seek(ext.id, ext);
+    allocated.push_back({ext.id, total});
+    if (total < ext.length)
+      ReplaceExtent(txn, *cursor, ext, {ext.id + total, ext.length - total});
+    else
+      EraseExtent(txn, *cursor, ext);
+  } else if (total) {
+    // Collect the IDs of extents until they cover #total. With next fit, the
+    // extents from the rotor on are tried first, the IDs before the rotor in
+    // the extent holding it left free, and then the extents from the first one
+    // on.
+    std::vector<FreeIdExtent> exts;
+    object_id_t found = 0, last_len = 0, from = 0;
+    bool more;
+    if (policy == AllocationPolicy::NextFit && cursor->SeekEnd(rotor, ext)) {
+      from = rotor;
+      more = true;
+    } else {
+      more = cursor->First(ext);
+    }
+    while (more) {
+      if (exts.empty() && ext.id < from)
+        exts.push_back({from, ext.id + ext.length - from});
+      else
+        exts.push_back(ext);
+      last_len = std::min(exts.back().length, total - found);
+      found += last_len;
+      if (found == total)
+        break;
+      more = cursor->Next(ext);
+      if (!more && from) {
+        exts.clear();
+        found = from = 0;
+        more = cursor->First(ext);
+      }
+    }
+    if (found < total) {
+      EndUpdate(txn);
+      return {};
+    }
+
+    // The cursor is at the last extent, which may be split. The extents before
+    // it are consumed whole, but for the IDs before the rotor.
+    TakeExtent(txn, *cursor, ext, exts.back().id, last_len);
+    for (size_t i = exts.size() - 1; i > 0; --i) {
+      cursor->Prev(ext);
+      if (ext.id < exts[i - 1].id)
+        ReplaceExtent(txn, *cursor, ext, {ext.id, exts[i - 1].id - ext.id});
+      else
+        EraseExtent(txn, *cursor, ext);
+    }
+
+    for (const FreeIdExtent &e : exts)
+      allocated.push_back({e.id, e.length});
+    allocated.back().second = last_len;
+  }
+  if (!allocated.empty())
+    rotor = allocated.back().first + allocated.back().second;
+  EndUpdate(txn);
+
+  // Hand the extents to the requests in order, splitting where a request ends
+  std::vector<std::vector<id_extent_t>> result(lens.size());
+  auto it = allocated.begin();
+  for (size_t i = 0; i < lens.size(); ++i) {
+    object_id_t len = lens[i];
+    while (len) {
+      object_id_t n = std::min(it->second, len);
+      result[i].push_back({it->first, n});
+      it->first += n;
+      it->second -= n;
+      len -= n;
+      if (!it->second)
+        ++it;
+    }
+  }
+  return result;
+}
 
 //
-// The maximal length of an extent allowed
+// Reserve the IDs of #ranges so that they are never allocated
+//
+// The ranges are sorted and coalesced first. The free extents are then swept
+// forward with a single cursor, taking the part of every extent that a range
+// overlaps and splitting the extent as needed. The cursor only seeks when a
+// range starts past the extent following the current one. The parts of the
+// ranges that no extent holds were allocated already, and are returned.
 //
-static constexpr uint64_t maximum_length = UINT64_MAX;
+// Deferred frees are merged first, as the IDs in the free log are free. The
+// whole log is merged in the transaction of the caller, so reserving with a
+// long log makes for a long transaction.
+//
+// With the bitmap backend, regions held by extents are taken whole and their
+// other IDs freed to bitmaps, as by IdAllocate(). With the buddy backend, the
+// free blocks overlapping a range are taken and their other IDs freed again.
+//
+template <typename Id>
+std::vector<basic_id_extent_t<Id>>
+BasicAllocator<Id>::IdReserveRanges(lmdb::txn &txn,
+                                    std::vector<id_extent_t> ranges) {
+  std::vector<id_extent_t> taken;
+  std::sort(ranges.begin(), ranges.end());
+  size_t n = 0;
+  for (const id_extent_t &r : ranges) {
+    if (!r.second)
+      continue;
+    if (n && r.first <= ranges[n - 1].first + ranges[n - 1].second)
+      ranges[n - 1].second = std::max<Id>(ranges[n - 1].second,
+                                          r.first + r.second -
+                                              ranges[n - 1].first);
+    else
+      ranges[n++] = r;
+  }
+  ranges.resize(n);
+  if (ranges.empty())
+    return taken;
 
-// Name of the database
-static const char *database_name = "Allocator";
+  CompactFreeLog(txn);
+  BeginUpdate(txn);
+  if (backend != AllocatorBackend::Extent) {
+    for (const id_extent_t &r : ranges) {
+      if (backend == AllocatorBackend::Buddy)
+        ReserveBlocks(txn, r.first, r.second, taken);
+      else
+        ReserveRun(txn, r.first, r.second, taken);
+    }
+    EndUpdate(txn);
+    return taken;
+  }
+
+  std::unique_ptr<ExtentCursor<Id>> cursor = OpenCursor(txn);
+  FreeIdExtent ext;
+  bool found = cursor->SeekEnd(ranges.front().first, ext);
+  for (const id_extent_t &r : ranges) {
+    object_id_t id = r.first, end = r.first + r.second;
+    // The extent following the current one is tried before seeking, as it is
+    // often the one
+    if (found && ExtentKey(ext) < id) {
+      found = cursor->Next(ext);
+      if (found && ExtentKey(ext) < id)
+        found = cursor->SeekEnd(id, ext);
+    }
+    while (id < end) {
+      if (!found || ext.id >= end) {
+        AppendRun<Id>(taken, id, end - id);
+        break;
+      }
+      if (id < ext.id) {
+        AppendRun<Id>(taken, id, ext.id - id);
+        id = ext.id;
+      }
+      object_id_t ext_end = ext.id + ext.length;
+      bool head = ext.id < id;
+      object_id_t len = std::min(end, ext_end) - id;
+      TakeExtent(txn, *cursor, ext, id, len);
+      id += len;
+      // Move to what follows the IDs taken: the next extent, or the rest of
+      // this one, which follows its head if any was left
+      if (id == ext_end)
+        found = cursor->Next(ext);
+      else if (head)
+        cursor->Next(ext);
+      else
+        ext = FreeIdExtent{id, ext_end - id};
+    }
+  }
+  EndUpdate(txn);
+  return taken;
+}
 
 //
-// Extent representing a range of free ID
+// Get the statistics of the free IDs
 //
-struct FreeIdExtent {
-  // Starting ID that is free
-  object_id_t id;
-  // Length of the extent
-  object_id_t length;
+// The statistics are read from the allocator metadata, so this costs a single
+// lookup whatever the number of free extents.
+//
+template <typename Id>
+BasicAllocatorStats<Id> BasicAllocator<Id>::Stats(lmdb::txn &txn) {
+  AllocatorStats result = AllocatorStats();
+  ReadStats(txn, meta_dbi, result);
+  // The tail is left out of the statistics kept, as bumping it would change
+  // them all the time
+  FreeIdExtent tail;
+  if (ReadTail(txn, meta_dbi, tail)) {
+    AddExtentStats(result, tail);
+    result.largest_extent = std::max(result.largest_extent, tail.length);
+  }
+  return result;
+}
+
+//
+// Lookup of free IDs in a transaction
+//
+// An ID is free if a free extent, the tail or a free block of the buddy backend
+// holds it, its bit is set in the bitmap of its region, or it was freed to the
+// free log. Only the databases are read, never the mirror or the state of the
+// allocator instance, so lookups work in read-only transactions of any thread.
+//
+// The extent cursor moves forward from one lookup to the next, so a run of
+// lookups in ascending order walks the free extents once.
+//
+// The free log is keyed by sequence number, so it cannot be sought by ID. It is
+// only read for IDs found free nowhere else. The first such ID is looked for by
+// walking the log, stopping at the entry holding it. The log is read whole and
+// sorted by ID only when a second one comes along.
+//
+template <typename Id> struct FreeIdLookup {
+  FreeIdLookup(lmdb::txn &txn, std::unique_ptr<ExtentCursor<Id>> cursor,
+               lmdb::dbi &meta_dbi, lmdb::dbi &bitmap_dbi,
+               lmdb::dbi &free_log_dbi, lmdb::dbi &buddy_dbi)
+      : txn(txn), bitmap_dbi(bitmap_dbi), free_log_dbi(free_log_dbi),
+        buddy_dbi(buddy_dbi), cursor(std::move(cursor)), found(false),
+        positioned(false), last_id(0), tail(), log_lookups(0),
+        region(IdTraits<Id>::Max()), has_bitmap(false) {
+    ReadTail(txn, meta_dbi, tail);
+    lmdb::val key, data;
+    lmdb::cursor buddy_cursor = lmdb::cursor::open(txn, buddy_dbi);
+    has_blocks = buddy_cursor.get(key, data, MDB_FIRST);
+  }
+
+  bool IsFree(Id id) {
+    // Move to the first extent ending at or after #id. Going forward, the
+    // extent following the current one is tried before seeking, as it is
+    // often the one.
+    if (!positioned || id < last_id) {
+      found = cursor->SeekEnd(id, ext);
+    } else if (found && ExtentKey(ext) < id) {
+      if (!cursor->Next(ext) || ExtentKey(ext) < id)
+        found = cursor->SeekEnd(id, ext);
+    }
+    positioned = true;
+    last_id = id;
+    if (found && ext.id <= id)
+      return true;
+    if (AllocatorCheckExtentHolds(tail, id))
+      return true;
+    // The block of every order that could hold #id is looked up
+    for (unsigned int order = 0; has_blocks && order < sizeof(Id) * 8;
+         ++order) {
+      BuddyKey<Id> key(order, id >> order << order);
+      lmdb::val data;
+      if (buddy_dbi.get(txn, key.val(), data))
+        return true;
+    }
+
+    if (id / region_length != region) {
+      region = id / region_length;
+      IdKey<Id> key(region);
+      has_bitmap = bitmap_dbi.get(txn, key.val(), bitmap);
+    }
+    if (has_bitmap) {
+      // Only the word of the ID is read from the bitmap
+      uint64_t bit = id % region_length, word;
+      std::memcpy(&word,
+                  bitmap.data<char>() + offsetof(IdBitmap, leaf) +
+                      bit / 64 * sizeof(uint64_t),
+                  sizeof(uint64_t));
+      if (word >> bit % 64 & 1)
+        return true;
+    }
+    return IsLogged(id);
+  }
+
+private:
+  // Check if #id was freed to the free log
+  bool IsLogged(Id id) {
+    if (log_lookups < 2) {
+      bool walk = !log_lookups++;
+      lmdb::val key, data;
+      lmdb::cursor log_cursor = lmdb::cursor::open(txn, free_log_dbi);
+      for (bool found = log_cursor.get(key, data, MDB_FIRST); found;
+           found = log_cursor.get(key, data, MDB_NEXT)) {
+        BasicFreeIdExtent<Id> ext;
+        std::memcpy(&ext, data.data(), sizeof(ext));
+        if (!walk)
+          logged.push_back({ext.id, ext.length});
+        else if (AllocatorCheckExtentHolds(ext, id))
+          return true;
+      }
+      if (walk)
+        return false;
+      std::sort(logged.begin(), logged.end());
+    }
+    auto it = std::upper_bound(logged.begin(), logged.end(),
+                               basic_id_extent_t<Id>{id, IdTraits<Id>::Max()});
+    return it != logged.begin() && id - (it - 1)->first < (it - 1)->second;
+  }
+
+  lmdb::txn &txn;
+  lmdb::dbi &bitmap_dbi;
+  lmdb::dbi &free_log_dbi;
+  lmdb::dbi &buddy_dbi;
+  // Cursor over the free extents, at #ext if #found
+  std::unique_ptr<ExtentCursor<Id>> cursor;
+  BasicFreeIdExtent<Id> ext;
+  bool found;
+  // Whether the cursor was moved for #last_id, the ID looked up last
+  bool positioned;
+  Id last_id;
+  // Tail kept out of the free extents, if any
+  BasicFreeIdExtent<Id> tail;
+  // Whether there are free blocks of the buddy backend
+  bool has_blocks;
+  // Number of IDs looked up in the free log
+  size_t log_lookups;
+  // Extents in the free log sorted by ID, read on the second lookup in it
+  std::vector<basic_id_extent_t<Id>> logged;
+  // Region looked up last, and its bitmap if #has_bitmap
+  Id region;
+  lmdb::val bitmap;
+  bool has_bitmap;
 };
 
 //
-// Free Extent Comparator
+// Check if #id is allocated
 //
-static int AllocatorCompare(const MDB_val *a, const MDB_val *b) {
-  FreeIdExtent *a_ext = static_cast<FreeIdExtent *>(a->mv_data);
-  FreeIdExtent *b_ext = static_cast<FreeIdExtent *>(b->mv_data);
-  assert(a->mv_size == b->mv_size && a->mv_size == sizeof(FreeIdExtent));
+template <typename Id>
+bool BasicAllocator<Id>::IsAllocated(lmdb::txn &txn, object_id_t id) {
+  FreeIdLookup<Id> lookup(txn, OpenDbCursor(txn), meta_dbi, bitmap_dbi,
+                          free_log_dbi, buddy_dbi);
+  return !lookup.IsFree(id);
+}
 
-  if (a_ext->id != b_ext->id)
-    return (a_ext->id < b_ext->id) ? -1 : 1;
-  return 0;
+//
+// Check if each of #ids is allocated
+//
+// The IDs are merged against the free extents with a single cursor walking
+// forward. IDs out of order are still answered correctly, at the cost of a
+// seek.
+//
+template <typename Id>
+std::vector<bool>
+BasicAllocator<Id>::AreAllocated(lmdb::txn &txn,
+                                 const std::vector<object_id_t> &ids) {
+  std::vector<bool> result(ids.size());
+  FreeIdLookup<Id> lookup(txn, OpenDbCursor(txn), meta_dbi, bitmap_dbi,
+                          free_log_dbi, buddy_dbi);
+  for (size_t i = 0; i < ids.size(); ++i)
+    result[i] = !lookup.IsFree(ids[i]);
+  return result;
 }
 
 //
-// Open/create the allocator in the environment
+// Write a snapshot file of #header and #size bytes of extents at #extents to
+// #temp_path, and rename it to #path
 //
-Allocator::Allocator(lmdb::env &env) try : dbi(0) {
-  lmdb::txn txn = lmdb::txn::begin(env);
-  try {
-    dbi = lmdb::dbi::open(txn, database_name, 0);
-  } catch (lmdb::not_found_error &) {
-    FreeIdExtent ext{0, maximum_length};
-    lmdb::val key(&ext, sizeof(FreeIdExtent));
-    lmdb::val data{};
-    dbi = lmdb::dbi::open(txn, database_name, MDB_CREATE);
-    dbi.put(txn, key, data);
+static void WriteSnapshotFile(const std::string &temp_path,
+                              const std::string &path,
+                              const FreeMapSnapshotHeader &header,
+                              const void *extents, size_t size) {
+  int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0644);
+  if (fd < 0)
+    throw std::system_error(errno, std::generic_category(), temp_path);
+  const char *bytes[] = {reinterpret_cast<const char *>(&header),
+                         static_cast<const char *>(extents)};
+  size_t sizes[] = {sizeof(header), size};
+  int error = 0;
+  for (int i = 0; i < 2 && !error; ++i) {
+    while (sizes[i] && !error) {
+      ssize_t written = ::write(fd, bytes[i], sizes[i]);
+      if (written < 0) {
+        if (errno != EINTR)
+          error = errno;
+        continue;
+      }
+      bytes[i] += written;
+      sizes[i] -= written;
+    }
+  }
+  if (!error && ::fsync(fd))
+    error = errno;
+  if (::close(fd) && !error)
+    error = errno;
+  if (!error && ::rename(temp_path.c_str(), path.c_str()))
+    error = errno;
+  if (error) {
+    ::unlink(temp_path.c_str());
+    throw std::system_error(error, std::generic_category(), path);
   }
-  dbi.set_compare(txn, AllocatorCompare);
-  txn.commit();
-} catch (const lmdb::error &e) {
-  std::cout << e.what();
-  throw;
 }
 
-Allocator::~Allocator() noexcept {}
+//
+// Get the version of the free IDs as recorded in snapshots
+//
+template <typename Id>
+FreeMapSnapshotVersion BasicAllocator<Id>::SnapshotVersion(lmdb::txn &txn) {
+  FreeMapSnapshotVersion version{ReadGeneration(txn, meta_dbi).generation,
+                                 ReadLogSequence(txn, meta_dbi, free_log_dbi),
+                                 0};
+  FreeIdExtent tail;
+  if (ReadTail(txn, meta_dbi, tail))
+    version.tail = static_cast<uint64_t>(tail.id);
+  return version;
+}
 
 //
-// Allocate an ID from the free extent database
+// Write the free IDs to a snapshot file at #path
 //
-// Currently the routine is very simple - it looks up the first extent in the
-// free ID database and return the starting ID of the found extent to the
-// caller.
+// The free extents, the tail, the free blocks, the runs of free IDs of every
+// bitmap and the free log are gathered, sorted by ID and merged. Only the
+// databases are read, as by IsAllocated(), so snapshots can be published from
+// a thread of their own.
 //
-optional<std::pair<object_id_t, object_id_t>>
-Allocator::IdAllocate(lmdb::txn &txn, object_id_t len) {
-  lmdb::val val_ext;
-  lmdb::cursor cursor = lmdb::cursor::open(txn, dbi);
-  if (!cursor.get(val_ext, MDB_FIRST))
-    return {};
+// The snapshot is written to a file of this instance next to #path, synced and
+// renamed over #path.
+//
+template <typename Id>
+void BasicAllocator<Id>::PublishSnapshot(lmdb::txn &txn,
+                                         const std::string &path) {
+  static_assert(sizeof(FreeIdExtent) ==
+                    sizeof(typename BasicFreeMapSnapshot<Id>::Extent),
+                "snapshots hold the free extents as they are");
+  std::vector<FreeIdExtent> extents;
+  FreeIdExtent ext;
+  {
+    std::unique_ptr<ExtentCursor<Id>> cursor = OpenDbCursor(txn);
+    for (bool found = cursor->First(ext); found; found = cursor->Next(ext))
+      extents.push_back(ext);
+  }
+  if (ReadTail(txn, meta_dbi, ext))
+    extents.push_back(ext);
 
-  FreeIdExtent ext = *val_ext.data<FreeIdExtent>();
-  object_id_t alloc_id = ext.id;
-  object_id_t alloc_id_len = std::min(ext.length, len);
-  cursor.del();
-  ext.id += alloc_id_len;
-  ext.length -= alloc_id_len;
-  if (ext.length) {
-    val_ext = lmdb::val(&ext, sizeof(FreeIdExtent));
-    cursor.put(val_ext);
+  lmdb::val key, data;
+  lmdb::cursor buddy_cursor = lmdb::cursor::open(txn, buddy_dbi);
+  for (bool found = buddy_cursor.get(key, data, MDB_FIRST); found;
+       found = buddy_cursor.get(key, data, MDB_NEXT))
+    extents.push_back(BuddyKey<Id>::Block(key));
+  buddy_cursor.close();
+
+  ReadBitmapRuns(txn, bitmap_dbi, extents);
+
+  lmdb::cursor log_cursor = lmdb::cursor::open(txn, free_log_dbi);
+  for (bool found = log_cursor.get(key, data, MDB_FIRST); found;
+       found = log_cursor.get(key, data, MDB_NEXT)) {
+    std::memcpy(&ext, data.data(), sizeof(FreeIdExtent));
+    extents.push_back(ext);
   }
+  log_cursor.close();
 
-  return {{alloc_id, alloc_id_len}};
+  std::sort(extents.begin(), extents.end(),
+            [](const FreeIdExtent &a, const FreeIdExtent &b) {
+              return a.id < b.id;
+            });
+  size_t count = 0;
+  for (const FreeIdExtent &e : extents) {
+    if (!e.length)
+      continue;
+    if (count && e.id <= extents[count - 1].id + extents[count - 1].length) {
+      FreeIdExtent &last = extents[count - 1];
+      last.length = std::max<Id>(last.length, e.id + e.length - last.id);
+    } else {
+      extents[count++] = e;
+    }
+  }
+
+  FreeMapSnapshotHeader header = FreeMapSnapshotHeader();
+  std::memcpy(header.magic, free_map_snapshot_magic, sizeof(header.magic));
+  header.format = free_map_snapshot_format;
+  header.id_width = sizeof(Id);
+  header.version = SnapshotVersion(txn);
+  header.count = count;
+
+  WriteSnapshotFile(path + "." + std::to_string(writer), path, header,
+                    extents.data(), count * sizeof(FreeIdExtent));
 }
 
 //
 // Check if the two extents are consecutive (providing that #a must be smaller
 // than #b)
 //
-static inline bool AllocatorCheckConsecutive(const FreeIdExtent *a,
-                                             const FreeIdExtent *b) {
+template <typename Id>
+static inline bool AllocatorCheckConsecutive(const BasicFreeIdExtent<Id> *a,
+                                             const BasicFreeIdExtent<Id> *b) {
   return a->id + a->length == b->id;
 }
 
 //
 // Check if two extents overlap
 //
-static inline bool AllocatorCheckExtentOverlap(const FreeIdExtent &Extent,
-                                               const FreeIdExtent &NewExtent) {
+template <typename Id>
+static inline bool
+AllocatorCheckExtentOverlap(const BasicFreeIdExtent<Id> &Extent,
+                            const BasicFreeIdExtent<Id> &NewExtent) {
   return NewExtent.id <= Extent.id + Extent.length - 1 &&
          Extent.id <= NewExtent.id + NewExtent.length - 1;
 }
 
 //
-// Free an ID to the free extent database
+// Free an ID
+//
+// With deferred frees, the IDs are only appended to the free log, and stay
+// allocated until the log is compacted.
 //
 // Double free of an ID is prohibited.
 //
-void Allocator::IdFree(lmdb::txn &txn, object_id_t id, object_id_t len) {
-  lmdb::cursor cursor = lmdb::cursor::open(txn, dbi);
-  FreeIdExtent ext{id, 0};
-  lmdb::val val_ext(&ext, sizeof(FreeIdExtent));
+template <typename Id>
+void BasicAllocator<Id>::IdFree(lmdb::txn &txn, object_id_t id,
+                                object_id_t len) {
+  if (deferred_free) {
+    AppendFreeLog(txn, id, len);
+    return;
+  }
+
+  BeginUpdate(txn);
+  if (backend == AllocatorBackend::Buddy)
+    BuddyFree(txn, id, len);
+  else if (backend == AllocatorBackend::Bitmap)
+    FreeRun(txn, id, len);
+  else
+    FreeExtent(txn, id, len);
+  EndUpdate(txn);
+}
+
+//
+// Free #len IDs starting at #id to the free extent database
+//
+template <typename Id>
+void BasicAllocator<Id>::FreeExtent(lmdb::txn &txn, object_id_t id,
+                                    object_id_t len) {
+  std::unique_ptr<ExtentCursor<Id>> cursor = OpenCursor(txn);
+  FreeIdExtent ext;
   bool allocator_full = false;
   // First find an extent with its id greater than #id
-  bool found = cursor.get(val_ext, MDB_SET_RANGE);
+  bool found = cursor->SeekRange(id, ext);
   if (!found) {
-    found = cursor.get(val_ext, MDB_LAST);
+    found = cursor->Last(ext);
     if (!found)
       allocator_full = true;
   }
@@ -127,43 +1980,672 @@ void Allocator::IdFree(lmdb::txn &txn, object_id_t id, object_id_t len) {
   FreeIdExtent new_ext{id, len};
   if (!allocator_full) {
     // There is at least one free extent presented in the database
-    ext = *val_ext.data<FreeIdExtent>();
     // Sanity check - the range to be freed must not be in database
-    assert(!AllocatorCheckExtentOverlap(lookup_ext, new_ext));
+    assert(!AllocatorCheckExtentOverlap(ext, new_ext));
     if (id > ext.id) {
       // Check if we can merge the extent smaller than #NewExtent
       if (AllocatorCheckConsecutive(&ext, &new_ext)) {
         new_ext.id = ext.id;
         new_ext.length += ext.length;
-        cursor.del();
+        ReplaceExtent(txn, *cursor, ext, new_ext);
+        return;
       }
       // We don't need to check the next extent in this case, as we can only
       // reach there if there is no more extent greater than #ID (Recall that we
       // failed the first lookup)
     } else {
-      // Check if we can merge the extent greater than #NewExtent
-      if (AllocatorCheckConsecutive(&new_ext, &ext)) {
-        new_ext.length += ext.length;
-        cursor.del();
-      }
+      // The extent greater than #NewExtent is merged last, as the merged extent
+      // keeps its last ID and is updated in place
+      FreeIdExtent next_ext = ext;
 
       // Check if merging with extents preceding #NewExtent is possible
-      found = cursor.get(val_ext, MDB_PREV);
+      found = cursor->Prev(ext);
       if (found) {
-        ext = *val_ext.data<FreeIdExtent>();
         // Sanity check - the range to be freed must not be in database
         assert(!AllocatorCheckExtentOverlap(ext, new_ext));
         // Check if we can merge the extent less than #NewExtent
         if (AllocatorCheckConsecutive(&ext, &new_ext)) {
           new_ext.id = ext.id;
           new_ext.length += ext.length;
-          cursor.del();
+          EraseExtent(txn, *cursor, ext);
         }
       }
+
+      // Check if we can merge the extent greater than #NewExtent
+      if (AllocatorCheckConsecutive(&new_ext, &next_ext)) {
+        if (found)
+          cursor->Next(ext);
+        else
+          cursor->Seek(next_ext.id, ext);
+        new_ext.length += next_ext.length;
+        ReplaceExtent(txn, *cursor, next_ext, new_ext);
+        return;
+      }
     }
   }
   // Insert the resulting new extent
-  cursor.put(lmdb::val(&new_ext, sizeof(FreeIdExtent)), lmdb::val());
+  InsertExtent(txn, *cursor, new_ext);
+}
+
+//
+// Free a batch of extents
+//
+// With deferred frees, the extents are appended to the free log instead.
+//
+template <typename Id>
+void BasicAllocator<Id>::IdFreeBatch(lmdb::txn &txn,
+                                     std::vector<id_extent_t> extents) {
+  if (!deferred_free) {
+    FreeBatch(txn, std::move(extents));
+    return;
+  }
+  for (const id_extent_t &e : extents)
+    if (e.second)
+      AppendFreeLog(txn, e.first, e.second);
+}
+
+//
+// Free a batch of extents to the free extent database
+//
+// The extents are sorted and coalesced in memory first, then merged into the
+// database in one forward sweep of a single cursor. Extents meeting each other
+// or the free extents already in the database are built up in memory and put
+// once, so a run of adjacent frees costs a single put.
+//
+// Double free of an ID is prohibited.
+//
+template <typename Id>
+void BasicAllocator<Id>::FreeBatch(lmdb::txn &txn,
+                                   std::vector<id_extent_t> extents) {
+  std::sort(extents.begin(), extents.end());
+  size_t n = 0;
+  for (const id_extent_t &e : extents) {
+    if (!e.second)
+      continue;
+    if (n && extents[n - 1].first + extents[n - 1].second == e.first)
+      extents[n - 1].second += e.second;
+    else
+      extents[n++] = e;
+  }
+  extents.resize(n);
+  if (extents.empty())
+    return;
+
+  BeginUpdate(txn);
+  if (backend != AllocatorBackend::Extent) {
+    for (const id_extent_t &e : extents) {
+      if (backend == AllocatorBackend::Buddy)
+        BuddyFree(txn, e.first, e.second);
+      else
+        FreeRun(txn, e.first, e.second);
+    }
+    EndUpdate(txn);
+    return;
+  }
+
+  // Start the sweep from the extent preceding the first range to be freed, as
+  // the two may have to be merged
+  std::unique_ptr<ExtentCursor<Id>> cursor = OpenCursor(txn);
+  FreeIdExtent ext;
+  bool found = cursor->SeekRange(extents.front().first, ext);
+  if (found)
+    found = cursor->Prev(ext) || cursor->First(ext);
+  else
+    found = cursor->Last(ext);
+
+  // #new_ext is the extent being built, which is not in the database yet. Once
+  // nothing more can be merged into it, it is put and the cursor is moved back
+  // to the extent following it.
+  FreeIdExtent new_ext{0, 0};
+  auto flush = [&]() {
+    InsertExtent(txn, *cursor, new_ext);
+    new_ext.length = 0;
+    found = cursor->Next(ext);
+  };
+
+  size_t i = 0;
+  while (i < extents.size()) {
+    FreeIdExtent free_ext{extents[i].first, extents[i].second};
+    if (found && ext.id < free_ext.id) {
+      // Sanity check - the range to be freed must not be in database
+      assert(!AllocatorCheckExtentOverlap(ext, free_ext));
+      if (new_ext.length && AllocatorCheckConsecutive(&new_ext, &ext)) {
+        new_ext.length += ext.length;
+        EraseExtent(txn, *cursor, ext);
+      } else if (new_ext.length) {
+        flush();
+        continue;
+      } else if (AllocatorCheckConsecutive(&ext, &free_ext)) {
+        new_ext = ext;
+        EraseExtent(txn, *cursor, ext);
+      }
+      found = cursor->Next(ext);
+    } else {
+      if (found)
+        assert(!AllocatorCheckExtentOverlap(ext, free_ext));
+      if (new_ext.length && AllocatorCheckConsecutive(&new_ext, &free_ext)) {
+        new_ext.length += free_ext.length;
+      } else {
+        if (new_ext.length)
+          flush();
+        new_ext = free_ext;
+      }
+      ++i;
+    }
+  }
+
+  // Check if we can merge the extent following the last range, which is then
+  // updated in place
+  if (found && AllocatorCheckConsecutive(&new_ext, &ext)) {
+    new_ext.length += ext.length;
+    ReplaceExtent(txn, *cursor, ext, new_ext);
+  } else {
+    InsertExtent(txn, *cursor, new_ext);
+  }
+  EndUpdate(txn);
+}
+
+//
+// Append the #len IDs starting at #id to the free log
+//
+// The log is keyed by a sequence number kept in the metadata, so every entry is
+// appended to the rightmost page of the log and no number is used twice, even
+// after the log is compacted.
+//
+template <typename Id>
+void BasicAllocator<Id>::AppendFreeLog(lmdb::txn &txn, object_id_t id,
+                                       object_id_t len) {
+  uint64_t seq = ReadLogSequence(txn, meta_dbi, free_log_dbi);
+  FreeIdExtent ext{id, len};
+  lmdb::val seq_key(&seq, sizeof(uint64_t));
+  lmdb::val ext_data(&ext, sizeof(FreeIdExtent));
+  free_log_dbi.put(txn, seq_key, ext_data, MDB_APPEND);
+
+  uint64_t next = seq + 1;
+  lmdb::val key(log_sequence_key, std::strlen(log_sequence_key));
+  lmdb::val data(&next, sizeof(uint64_t));
+  meta_dbi.put(txn, key, data);
+}
+
+//
+// Merge the oldest entries of the free log into the free extents
+//
+// Up to #max_entries entries, or all of them if it is 0, are taken off the log
+// and freed as one batch: sorted, coalesced and merged in one sweep. The number
+// of entries merged is returned.
+//
+template <typename Id>
+size_t BasicAllocator<Id>::CompactFreeLog(lmdb::txn &txn, size_t max_entries) {
+  std::vector<id_extent_t> extents;
+  lmdb::val key, data;
+  lmdb::cursor cursor = lmdb::cursor::open(txn, free_log_dbi);
+  for (bool found = cursor.get(key, data, MDB_FIRST);
+       found && (!max_entries || extents.size() < max_entries);
+       found = cursor.get(key, data, MDB_NEXT)) {
+    FreeIdExtent ext;
+    std::memcpy(&ext, data.data(), sizeof(FreeIdExtent));
+    extents.push_back({ext.id, ext.length});
+    cursor.del();
+  }
+  cursor.close();
+
+  size_t merged = extents.size();
+  FreeBatch(txn, std::move(extents));
+  return merged;
+}
+
+//
+// Allocate a run of up to #len IDs with the bitmap backend
+//
+// Short requests are served from the bitmaps first, as they hold the scattered
+// free IDs. Otherwise the extent found by the allocation policy is used: whole
+// regions are handed out right from it if the request covers one, or else the
+// region at its start becomes a bitmap to allocate from. With next fit, an
+// extent holding the rotor is used from the rotor on.
+//
+template <typename Id>
+optional<basic_id_extent_t<Id>>
+BasicAllocator<Id>::AllocateRun(lmdb::txn &txn, object_id_t len) {
+  if (!len)
+    return {};
+  if (len < region_length)
+    if (optional<id_extent_t> run = AllocateFromBitmap(txn, len))
+      return run;
+
+  FreeIdExtent ext;
+  std::unique_ptr<ExtentCursor<Id>> cursor = OpenCursor(txn);
+  if (!SeekExtent(txn, *cursor, len, ext))
+    return AllocateFromBitmap(txn, len);
+
+  object_id_t from = ext.id;
+  if (policy == AllocationPolicy::NextFit &&
+      AllocatorCheckExtentHolds(ext, rotor))
+    from = rotor;
+  return AllocateRunAt(txn, std::move(cursor), ext, from, len);
+}
+
+//
+// Allocate a run of up to #len IDs from #from on in the extent #ext
+//
+// #cursor is at #ext, and closed before the extent is turned into a bitmap.
+//
+template <typename Id>
+optional<basic_id_extent_t<Id>> BasicAllocator<Id>::AllocateRunAt(
+    lmdb::txn &txn, std::unique_ptr<ExtentCursor<Id>> cursor,
+    const FreeIdExtent &ext, object_id_t from, object_id_t len) {
+  object_id_t available = ext.id + ext.length - from;
+  if (from % region_length == 0 && available >= region_length &&
+      len >= region_length) {
+    object_id_t alloc_id_len =
+        std::min(available, len) / region_length * region_length;
+    TakeExtent(txn, *cursor, ext, from, alloc_id_len);
+    return {{from, alloc_id_len}};
+  }
+
+  IdBitmap bitmap;
+  object_id_t region = from / region_length;
+  uint64_t bit;
+  cursor.reset();
+  MakeBitmap(txn, region, bitmap);
+  if (from == ext.id)
+    bitmap.FindFree(bit);
+  else
+    bitmap.FindFree(from % region_length, bit);
+  object_id_t alloc_id_len = bitmap.Take(bit, std::min<Id>(len, region_length));
+  StoreBitmap(txn, region, bitmap, 0);
+  return {{region * region_length + bit, alloc_id_len}};
+}
+
+//
+// Allocate a run of up to #len IDs from the first bitmap
+//
+// The bitmaps are keyed by region and only kept while they have a free ID, so
+// the first one in the database holds the lowest free ID among them.
+//
+// With next fit, the bitmap of the rotor is tried from the rotor on first, and
+// then the bitmaps following it, wrapping around to the first one.
+//
+template <typename Id>
+optional<basic_id_extent_t<Id>>
+BasicAllocator<Id>::AllocateFromBitmap(lmdb::txn &txn, object_id_t len) {
+  bool next_fit = policy == AllocationPolicy::NextFit;
+  if (next_fit)
+    if (optional<id_extent_t> run = AllocateNearInBitmap(txn, rotor, len))
+      return run;
+  IdKey<Id> next_region(rotor / region_length + 1);
+  lmdb::val key = next_region.val(), data;
+  lmdb::cursor cursor = lmdb::cursor::open(txn, bitmap_dbi);
+  if (!(next_fit && cursor.get(key, data, MDB_SET_RANGE)) &&
+      !cursor.get(key, data, MDB_FIRST))
+    return {};
+  object_id_t region = IdKey<Id>::Get(key);
+  IdBitmap bitmap;
+  std::memcpy(&bitmap, data.data(), sizeof(IdBitmap));
+  cursor.close();
+
+  uint64_t bit, free_count = bitmap.free_count;
+  bool found = bitmap.FindFree(bit);
+  assert(found);
+  (void)found;
+  object_id_t alloc_id_len = bitmap.Take(bit, std::min<Id>(len, region_length));
+  StoreBitmap(txn, region, bitmap, free_count);
+  return {{region * region_length + bit, alloc_id_len}};
+}
+
+//
+// Allocate a run of up to #len IDs at or after #hint in its bitmap
+//
+template <typename Id>
+optional<basic_id_extent_t<Id>>
+BasicAllocator<Id>::AllocateNearInBitmap(lmdb::txn &txn, object_id_t hint,
+                                         object_id_t len) {
+  IdBitmap bitmap;
+  object_id_t region = hint / region_length;
+  uint64_t bit;
+  if (!len || !LoadBitmap(txn, region, bitmap) ||
+      !bitmap.FindFree(hint % region_length, bit))
+    return {};
+  uint64_t free_count = bitmap.free_count;
+  object_id_t alloc_id_len = bitmap.Take(bit, std::min<Id>(len, region_length));
+  StoreBitmap(txn, region, bitmap, free_count);
+  return {{region * region_length + bit, alloc_id_len}};
+}
+
+//
+// Free #len IDs starting at #id with the bitmap backend
+//
+// Regions freed whole were wholly used, so they go to the free extents
+// directly. The IDs of other regions are marked in their bitmaps, and a bitmap
+// becoming wholly free is turned back into an extent.
+//
+template <typename Id>
+void BasicAllocator<Id>::FreeRun(lmdb::txn &txn, object_id_t id,
+                                 object_id_t len) {
+  while (len) {
+    object_id_t region = id / region_length;
+    object_id_t start = region * region_length;
+    object_id_t n = std::min(len, start + RegionLength(region) - id);
+    if (id == start && n == RegionLength(region)) {
+      n = std::max<Id>(n, len / region_length * region_length);
+      FreeExtent(txn, id, n);
+    } else {
+      IdBitmap bitmap;
+      uint64_t free_count = 0;
+      if (LoadBitmap(txn, region, bitmap))
+        free_count = bitmap.free_count;
+      else
+        MakeBitmap(txn, region, bitmap);
+      bitmap.Release(id - start, n);
+      if (bitmap.free_count == RegionLength(region)) {
+        // The bitmap is dropped for an extent of the whole region
+        bitmap.Clear();
+        StoreBitmap(txn, region, bitmap, free_count);
+        FreeExtent(txn, start, RegionLength(region));
+      } else {
+        StoreBitmap(txn, region, bitmap, free_count);
+      }
+    }
+    id += n;
+    len -= n;
+  }
+}
+
+//
+// Reserve the #len IDs starting at #id with the bitmap backend
+//
+// The free IDs of a region with a bitmap are taken from the bitmap. A region
+// without one is either held whole by an extent or wholly allocated. The
+// regions of an extent that the IDs overlap are taken whole, and their IDs
+// outside of #id and #len freed to bitmaps again.
+//
+template <typename Id>
+void BasicAllocator<Id>::ReserveRun(lmdb::txn &txn, object_id_t id,
+                                    object_id_t len,
+                                    std::vector<id_extent_t> &taken) {
+  object_id_t end = id + len;
+  while (id < end) {
+    object_id_t region = id / region_length;
+    object_id_t start = region * region_length;
+    object_id_t stop = std::min(end, start + RegionLength(region));
+    IdBitmap bitmap;
+    if (LoadBitmap(txn, region, bitmap)) {
+      uint64_t free_count = bitmap.free_count;
+      for (uint64_t bit = id - start, last = stop - start; bit < last;) {
+        bool free = bitmap.IsFree(bit);
+        uint64_t next = bit + 1;
+        while (next < last && bitmap.IsFree(next) == free)
+          ++next;
+        if (free)
+          bitmap.Take(bit, next - bit);
+        else
+          AppendRun<Id>(taken, start + bit, next - bit);
+        bit = next;
+      }
+      StoreBitmap(txn, region, bitmap, free_count);
+      id = stop;
+      continue;
+    }
+
+    FreeIdExtent ext;
+    std::unique_ptr<ExtentCursor<Id>> cursor = OpenCursor(txn);
+    if (!cursor->SeekEnd(id, ext) || ext.id >= stop) {
+      AppendRun<Id>(taken, id, stop - id);
+      id = stop;
+      continue;
+    }
+    if (id < ext.id) {
+      AppendRun<Id>(taken, id, ext.id - id);
+      id = ext.id;
+    }
+    object_id_t ext_end = ext.id + ext.length;
+    object_id_t from = std::max<Id>(ext.id, id / region_length * region_length);
+    object_id_t to = std::min(end, ext_end);
+    object_id_t span_end =
+        to + std::min<Id>(ext_end - to, (region_length - to % region_length) %
+                                            region_length);
+    TakeExtent(txn, *cursor, ext, from, span_end - from);
+    cursor.reset();
+    if (from < id)
+      FreeRun(txn, from, id - from);
+    if (to < span_end)
+      FreeRun(txn, to, span_end - to);
+    id = to;
+  }
+}
+
+//
+// Read the bitmap of #region
+//
+template <typename Id>
+bool BasicAllocator<Id>::LoadBitmap(lmdb::txn &txn, object_id_t region,
+                                    IdBitmap &bitmap) {
+  IdKey<Id> key(region);
+  lmdb::val data;
+  if (!bitmap_dbi.get(txn, key.val(), data))
+    return false;
+  std::memcpy(&bitmap, data.data(), sizeof(IdBitmap));
+  return true;
+}
+
+//
+// Write the bitmap of #region, removing it if no ID is free
+//
+// #free_count is the number of free IDs the stored bitmap had, 0 if there was
+// none, for the statistics to follow.
+//
+template <typename Id>
+void BasicAllocator<Id>::StoreBitmap(lmdb::txn &txn, object_id_t region,
+                                     const IdBitmap &bitmap,
+                                     uint64_t free_count) {
+  IdKey<Id> region_key(region);
+  lmdb::val key = region_key.val();
+  if (bitmap.free_count) {
+    lmdb::val data(&bitmap, sizeof(IdBitmap));
+    bitmap_dbi.put(txn, key, data);
+  } else if (free_count) {
+    bitmap_dbi.del(txn, key);
+  }
+  // The difference is taken in the type of the statistics, not at 64 bits
+  stats.free_ids = stats.free_ids + bitmap.free_count - free_count;
+  stats.bitmaps += (bitmap.free_count != 0) - (free_count != 0);
+  updated = true;
+}
+
+//
+// Move the free extents in #region into #bitmap
+//
+// The parts of the extents outside the region are kept as extents.
+//
+template <typename Id>
+void BasicAllocator<Id>::MakeBitmap(lmdb::txn &txn, object_id_t region,
+                                    IdBitmap &bitmap) {
+  object_id_t start = region * region_length;
+  object_id_t end = start + RegionLength(region);
+  bitmap.Clear();
+
+  // An extent starting before the region may reach into it
+  FreeIdExtent ext;
+  std::unique_ptr<ExtentCursor<Id>> cursor = OpenCursor(txn);
+  bool found = cursor->SeekRange(start, ext);
+  bool before = found ? cursor->Prev(ext) : cursor->Last(ext);
+  if (!before || ext.id + ext.length <= start)
+    found = before ? cursor->Next(ext) : cursor->First(ext);
+  else
+    found = true;
+
+  while (found && ext.id < end) {
+    object_id_t ext_end = ext.id + ext.length;
+    object_id_t lo = std::max(ext.id, start), hi = std::min(ext_end, end);
+    bitmap.Release(lo - start, hi - lo);
+    if (ext_end > end) {
+      ReplaceExtent(txn, *cursor, ext, {end, ext_end - end});
+      if (ext.id < start)
+        InsertExtent(txn, *cursor, {ext.id, start - ext.id});
+      break;
+    }
+    if (ext.id < start)
+      ReplaceExtent(txn, *cursor, ext, {ext.id, start - ext.id});
+    else
+      EraseExtent(txn, *cursor, ext);
+    found = cursor->Next(ext);
+  }
+}
+
+//
+// Allocate up to #len IDs from a block of at least #order with the buddy
+// backend, or from a smaller block if #truncate
+//
+// The free lists are sorted by order, so the first block from #order on is the
+// smallest large enough, and among those the one with the lowest ID. Failing
+// that, the last block is the largest one.
+//
+template <typename Id>
+optional<basic_id_extent_t<Id>>
+BasicAllocator<Id>::BuddyAllocate(lmdb::txn &txn, object_id_t len,
+                                  unsigned int order, bool truncate) {
+  if (!len)
+    return {};
+  BuddyKey<Id> list(order, 0);
+  lmdb::val key = list.val(), data;
+  lmdb::cursor cursor = lmdb::cursor::open(txn, buddy_dbi);
+  if (!cursor.get(key, data, MDB_SET_RANGE)) {
+    if (!truncate || !cursor.get(key, data, MDB_LAST))
+      return {};
+    order = BuddyKey<Id>::Order(key);
+  }
+  FreeIdExtent block = BuddyKey<Id>::Block(key);
+  cursor.close();
+  return TakeBlock(txn, block, order, len);
+}
+
+//
+// Take up to #len IDs from the free block #block, split down to #order
+//
+// The upper half of the block is freed at every split, leaving the block of
+// #order at the start of #block to allocate from. The IDs of that block past
+// #len are freed again.
+//
+template <typename Id>
+basic_id_extent_t<Id> BasicAllocator<Id>::TakeBlock(lmdb::txn &txn,
+                                                    const FreeIdExtent &block,
+                                                    unsigned int order,
+                                                    object_id_t len) {
+  unsigned int block_order = IdTraits<Id>::Log2(block.length);
+  EraseBlock(txn, block_order, block.id);
+  while (block_order > order) {
+    --block_order;
+    InsertBlock(txn, block_order, block.id + (Id(1) << block_order));
+  }
+  object_id_t length = Id(1) << order;
+  object_id_t alloc_id_len = std::min(len, length);
+  if (alloc_id_len < length)
+    BuddyFree(txn, block.id + alloc_id_len, length - alloc_id_len);
+  return {block.id, alloc_id_len};
+}
+
+//
+// Free #len IDs starting at #id with the buddy backend
+//
+// The IDs are cut into the largest blocks aligned to their length. Every block
+// is coalesced with its buddy, the other half of the block of the order above,
+// for as long as the buddy is free.
+//
+template <typename Id>
+void BasicAllocator<Id>::BuddyFree(lmdb::txn &txn, object_id_t id,
+                                   object_id_t len) {
+  while (len) {
+    unsigned int order = IdTraits<Id>::Log2(len);
+    if (id)
+      order = std::min(order, IdTraits<Id>::Log2(id & (0 - id)));
+    object_id_t length = Id(1) << order;
+    object_id_t block = id;
+    while (order + 1 < sizeof(Id) * 8 &&
+           EraseBlock(txn, order, block ^ Id(1) << order)) {
+      block &= ~(Id(1) << order);
+      ++order;
+    }
+    InsertBlock(txn, order, block);
+    id += length;
+    len -= length;
+  }
+}
+
+//
+// Reserve the #len IDs starting at #id with the buddy backend
+//
+// The block holding the next ID to reserve is looked up in every order, as by
+// IsAllocated(). It is taken, and its IDs outside of #id and #len freed again.
+// If no block holds the ID, the IDs up to the first block after it were
+// allocated already.
+//
+template <typename Id>
+void BasicAllocator<Id>::ReserveBlocks(lmdb::txn &txn, object_id_t id,
+                                       object_id_t len,
+                                       std::vector<id_extent_t> &taken) {
+  object_id_t end = id + len;
+  while (id < end) {
+    unsigned int order = 0;
+    object_id_t block = 0;
+    for (; order < sizeof(Id) * 8; ++order) {
+      block = id >> order << order;
+      BuddyKey<Id> key(order, block);
+      lmdb::val data;
+      if (buddy_dbi.get(txn, key.val(), data))
+        break;
+    }
+
+    if (order < sizeof(Id) * 8) {
+      object_id_t block_end = block + (Id(1) << order);
+      object_id_t to = std::min(end, block_end);
+      EraseBlock(txn, order, block);
+      if (block < id)
+        BuddyFree(txn, block, id - block);
+      if (to < block_end)
+        BuddyFree(txn, to, block_end - to);
+      id = to;
+      continue;
+    }
+
+    object_id_t next = end;
+    lmdb::val key, data;
+    lmdb::cursor cursor = lmdb::cursor::open(txn, buddy_dbi);
+    for (order = 0; order < sizeof(Id) * 8; ++order) {
+      BuddyKey<Id> list(order, id);
+      key = list.val();
+      if (cursor.get(key, data, MDB_SET_RANGE) &&
+          BuddyKey<Id>::Order(key) == order)
+        next = std::min(next, BuddyKey<Id>::Block(key).id);
+    }
+    AppendRun<Id>(taken, id, next - id);
+    id = next;
+  }
+}
+
+//
+// Add the block of #order at #id to the free blocks
+//
+template <typename Id>
+void BasicAllocator<Id>::InsertBlock(lmdb::txn &txn, unsigned int order,
+                                     object_id_t id) {
+  BuddyKey<Id> block_key(order, id);
+  lmdb::val key = block_key.val(), data;
+  buddy_dbi.put(txn, key, data);
+  AddExtentStats(stats, FreeIdExtent{id, Id(1) << order});
+  updated = true;
+}
+
+//
+// Remove the block of #order at #id from the free blocks, if it is free
+//
+template <typename Id>
+bool BasicAllocator<Id>::EraseBlock(lmdb::txn &txn, unsigned int order,
+                                    object_id_t id) {
+  BuddyKey<Id> block_key(order, id);
+  if (!buddy_dbi.del(txn, block_key.val()))
+    return false;
+  RemoveExtentStats(stats, FreeIdExtent{id, Id(1) << order});
+  updated = true;
+  return true;
 }
 
 #if 0
@@ -246,4 +2728,10 @@ void Allocator::IdFree(lmdb::txn &txn, object_id_t id, object_id_t len) {
   return Cursor.put(ExtentKey, ExtentData, 0);
 }
 
-#endif
\ No newline at end of file
+#endif
+
+template struct BasicAllocator<uint32_t>;
+template struct BasicAllocator<uint64_t>;
+#ifdef __SIZEOF_INT128__
+template struct BasicAllocator<uint128_t>;
+#endif
@@ -0,0 +1,129 @@
+#include "allocator_service.h"
+
+#include <exception>
+
+//
+// Start serving requests against #allocator
+//
+AllocatorService::AllocatorService(lmdb::env &env, Allocator &allocator,
+                                   std::chrono::microseconds window,
+                                   size_t max_batch)
+    : env(env),
+      allocator(allocator),
+      window(window),
+      max_batch(max_batch ? max_batch : 1),
+      stopping(false),
+      thread(&AllocatorService::Run, this) {}
+
+//
+// Serve the requests left in the queue and stop
+//
+AllocatorService::~AllocatorService() noexcept {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  cond.notify_one();
+  thread.join();
+}
+
+std::future<optional<id_extent_t>>
+AllocatorService::IdAllocate(object_id_t len) {
+  Request request;
+  request.free = false;
+  request.id = 0;
+  request.len = len;
+  std::future<optional<id_extent_t>> result = request.allocated.get_future();
+  Enqueue(std::move(request));
+  return result;
+}
+
+std::future<void> AllocatorService::IdFree(object_id_t id, object_id_t len) {
+  Request request;
+  request.free = true;
+  request.id = id;
+  request.len = len;
+  std::future<void> result = request.freed.get_future();
+  Enqueue(std::move(request));
+  return result;
+}
+
+void AllocatorService::Enqueue(Request &&request) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    queue.push_back(std::move(request));
+  }
+  cond.notify_one();
+}
+
+//
+// Body of the writer thread
+//
+// The window starts when the writer sees the queue non-empty, and is cut short
+// once a full batch is queued or the service is stopped.
+//
+void AllocatorService::Run() {
+  std::vector<Request> batch;
+  std::unique_lock<std::mutex> lock(mutex);
+  for (;;) {
+    cond.wait(lock, [this] { return stopping || !queue.empty(); });
+    if (queue.empty())
+      break;
+    cond.wait_until(lock, std::chrono::steady_clock::now() + window, [this] {
+      return stopping || queue.size() >= max_batch;
+    });
+
+    while (!queue.empty() && batch.size() < max_batch) {
+      batch.push_back(std::move(queue.front()));
+      queue.pop_front();
+    }
+    lock.unlock();
+    Serve(batch);
+    batch.clear();
+    lock.lock();
+  }
+}
+
+//
+// Serve #batch in one write transaction
+//
+// Requests are served in the order they were queued, with every run of frees
+// merged in one IdFreeBatch().
+//
+void AllocatorService::Serve(std::vector<Request> &batch) {
+  std::vector<optional<id_extent_t>> results(batch.size());
+  try {
+    lmdb::txn txn = lmdb::txn::begin(env);
+    std::vector<id_extent_t> frees;
+    for (size_t i = 0; i < batch.size(); ++i) {
+      if (batch[i].free) {
+        frees.push_back({batch[i].id, batch[i].len});
+        continue;
+      }
+      if (!frees.empty()) {
+        allocator.IdFreeBatch(txn, std::move(frees));
+        frees.clear();
+      }
+      results[i] = allocator.IdAllocate(txn, batch[i].len);
+    }
+    if (!frees.empty())
+      allocator.IdFreeBatch(txn, std::move(frees));
+    txn.commit();
+  } catch (...) {
+    std::exception_ptr e = std::current_exception();
+    for (Request &request : batch) {
+      if (request.free)
+        request.freed.set_exception(e);
+      else
+        request.allocated.set_exception(e);
+    }
+    return;
+  }
+
+  for (size_t i = 0; i < batch.size(); ++i) {
+    if (batch[i].free)
+      batch[i].freed.set_value();
+    else
+      batch[i].allocated.set_value(results[i]);
+  }
+}
@@ -0,0 +1,323 @@
+#include <allocator.h>
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+//
+// Allocator microbenchmark
+//
+// For every number of free extents to start from, a fresh environment is
+// fragmented into that many single-ID holes once. Then, for every combination
+// of transaction batch size, allocation length and free pattern, IDs are
+// allocated and freed again, which brings the free extents back to where they
+// started. The free patterns are:
+//
+// - sequential: in the order the IDs were allocated
+// - random: in a random order
+// - interleaved: every other allocation first, then the rest
+//
+// The results are written to stdout as JSON, one object per combination with
+// the throughput, commits included, and the latency percentiles of the calls.
+//
+
+typedef std::chrono::steady_clock bench_clock;
+
+//
+// Options of a benchmark run
+//
+struct BenchOptions {
+  // Directory of the environments
+  std::string path = "bench.mdb";
+  // Operations per measurement
+  size_t ops = 100000;
+  // Numbers of free extents to start from
+  std::vector<size_t> extents{1000, 10000, 100000, 1000000, 10000000};
+  // Numbers of operations per write transaction
+  std::vector<size_t> batches{1, 10, 100, 1000};
+  // Lengths of allocations
+  std::vector<object_id_t> lengths{1, 16, 1024};
+  // Options of the allocator
+  AllocatorOptions allocator;
+  // Whether commits are synced to disk
+  bool sync = false;
+};
+
+//
+// Measurement of one kind of operation
+//
+struct BenchResult {
+  // Number of operations
+  size_t ops = 0;
+  // Wall time of all operations and commits
+  double seconds = 0;
+  // Latency of every call in nanoseconds
+  std::vector<uint64_t> latencies;
+};
+
+static const char *free_patterns[] = {"sequential", "random", "interleaved"};
+
+//
+// Parse a comma separated list of numbers
+//
+template <typename T> static std::vector<T> ParseList(const char *arg) {
+  std::vector<T> list;
+  std::stringstream ss(arg);
+  std::string item;
+  while (std::getline(ss, item, ','))
+    list.push_back(std::strtoull(item.c_str(), nullptr, 0));
+  return list;
+}
+
+static void Usage(const char *prog) {
+  std::cerr << "Usage: " << prog
+            << " [--path DIR] [--ops N] [--extents N,...] [--batches N,...]"
+               " [--lengths N,...] [--policy first|best|next]"
+               " [--backend extent|bitmap|buddy] [--mirror] [--packed]"
+               " [--bump-tail] [--sync]"
+            << std::endl;
+}
+
+static bool ParseOptions(int argc, char *argv[], BenchOptions &options) {
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--mirror") {
+      options.allocator.mirror = true;
+      continue;
+    }
+    if (arg == "--packed") {
+      options.allocator.packed_extents = true;
+      continue;
+    }
+    if (arg == "--bump-tail") {
+      options.allocator.bump_tail = true;
+      continue;
+    }
+    if (arg == "--sync") {
+      options.sync = true;
+      continue;
+    }
+    if (i + 1 == argc)
+      return false;
+    const char *value = argv[++i];
+    if (arg == "--path")
+      options.path = value;
+    else if (arg == "--ops")
+      options.ops = std::strtoull(value, nullptr, 0);
+    else if (arg == "--extents")
+      options.extents = ParseList<size_t>(value);
+    else if (arg == "--batches")
+      options.batches = ParseList<size_t>(value);
+    else if (arg == "--lengths")
+      options.lengths = ParseList<object_id_t>(value);
+    else if (arg == "--policy" && !std::strcmp(value, "first"))
+      options.allocator.policy = AllocationPolicy::FirstFit;
+    else if (arg == "--policy" && !std::strcmp(value, "best"))
+      options.allocator.policy = AllocationPolicy::BestFit;
+    else if (arg == "--policy" && !std::strcmp(value, "next"))
+      options.allocator.policy = AllocationPolicy::NextFit;
+    else if (arg == "--backend" && !std::strcmp(value, "extent"))
+      options.allocator.backend = AllocatorBackend::Extent;
+    else if (arg == "--backend" && !std::strcmp(value, "bitmap"))
+      options.allocator.backend = AllocatorBackend::Bitmap;
+    else if (arg == "--backend" && !std::strcmp(value, "buddy"))
+      options.allocator.backend = AllocatorBackend::Buddy;
+    else
+      return false;
+  }
+  return options.ops > 0;
+}
+
+//
+// Create an empty environment at #path
+//
+static lmdb::env OpenEnv(const std::string &path, bool sync) {
+  mkdir(path.c_str(), 0755);
+  std::remove((path + "/data.mdb").c_str());
+  std::remove((path + "/lock.mdb").c_str());
+  lmdb::env env = lmdb::env::create();
+  env.set_max_dbs(8);
+  env.set_mapsize(1ull * 1024 * 1024 * 1024 * 1024); // 1TiB max. mapsize
+  env.open(path.c_str(), sync ? 0 : MDB_NOSYNC);
+  return env;
+}
+
+//
+// Fragment the free IDs into #extents holes of a single ID
+//
+// Twice as many IDs are allocated, and every other one is freed again.
+//
+static void Fragment(lmdb::env &env, Allocator &allocator, size_t extents) {
+  const size_t chunk = 1000000;
+  for (size_t done = 0; done < extents; done += chunk) {
+    size_t n = std::min(chunk, extents - done);
+    lmdb::txn txn = lmdb::txn::begin(env);
+    auto r = allocator.IdAllocateN(txn, 2 * n);
+    std::vector<id_extent_t> holes;
+    for (const id_extent_t &e : *r)
+      for (object_id_t id = e.first; id < e.first + e.second; id += 2)
+        holes.push_back({id, 1});
+    allocator.IdFreeBatch(txn, std::move(holes));
+    txn.commit();
+  }
+}
+
+//
+// Allocate #ops times #len IDs, committing every #batch operations
+//
+static BenchResult RunAllocate(lmdb::env &env, Allocator &allocator,
+                               size_t ops, size_t batch, object_id_t len,
+                               std::vector<id_extent_t> &allocated) {
+  BenchResult result;
+  result.latencies.reserve(ops);
+  auto begin = bench_clock::now();
+  lmdb::txn txn = lmdb::txn::begin(env);
+  for (size_t i = 0; i < ops; ++i) {
+    auto start = bench_clock::now();
+    auto r = allocator.IdAllocate(txn, len);
+    auto end = bench_clock::now();
+    result.latencies.push_back(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+            .count());
+    if (r)
+      allocated.push_back(*r);
+    if ((i + 1) % batch == 0) {
+      txn.commit();
+      txn = lmdb::txn::begin(env);
+    }
+  }
+  txn.commit();
+  result.ops = ops;
+  result.seconds =
+      std::chrono::duration<double>(bench_clock::now() - begin).count();
+  return result;
+}
+
+//
+// Free #allocated in the order of #pattern, committing every #batch operations
+//
+static BenchResult RunFree(lmdb::env &env, Allocator &allocator, size_t batch,
+                           const std::string &pattern,
+                           std::vector<id_extent_t> allocated) {
+  if (pattern == "random") {
+    std::mt19937_64 rng(42);
+    std::shuffle(allocated.begin(), allocated.end(), rng);
+  } else if (pattern == "interleaved") {
+    std::vector<id_extent_t> order;
+    order.reserve(allocated.size());
+    for (size_t start = 0; start < 2; ++start)
+      for (size_t i = start; i < allocated.size(); i += 2)
+        order.push_back(allocated[i]);
+    allocated.swap(order);
+  }
+
+  BenchResult result;
+  result.latencies.reserve(allocated.size());
+  auto begin = bench_clock::now();
+  lmdb::txn txn = lmdb::txn::begin(env);
+  for (size_t i = 0; i < allocated.size(); ++i) {
+    auto start = bench_clock::now();
+    allocator.IdFree(txn, allocated[i].first, allocated[i].second);
+    auto end = bench_clock::now();
+    result.latencies.push_back(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+            .count());
+    if ((i + 1) % batch == 0) {
+      txn.commit();
+      txn = lmdb::txn::begin(env);
+    }
+  }
+  txn.commit();
+  result.ops = allocated.size();
+  result.seconds =
+      std::chrono::duration<double>(bench_clock::now() - begin).count();
+  return result;
+}
+
+//
+// Write #result as a JSON object
+//
+static void PrintResult(BenchResult &result) {
+  std::vector<uint64_t> &lat = result.latencies;
+  std::sort(lat.begin(), lat.end());
+  auto percentile = [&](double p) -> uint64_t {
+    if (lat.empty())
+      return 0;
+    return lat[std::min(lat.size() - 1, size_t(p * lat.size()))];
+  };
+  std::cout << "{\"ops\": " << result.ops << ", \"seconds\": " << result.seconds
+            << ", \"ops_per_sec\": "
+            << (result.seconds > 0 ? result.ops / result.seconds : 0)
+            << ", \"latency_ns\": {\"p50\": " << percentile(0.5)
+            << ", \"p90\": " << percentile(0.9)
+            << ", \"p99\": " << percentile(0.99)
+            << ", \"p999\": " << percentile(0.999)
+            << ", \"max\": " << (lat.empty() ? 0 : lat.back()) << "}}";
+}
+
+int main(int argc, char *argv[]) {
+  BenchOptions options;
+  if (!ParseOptions(argc, argv, options)) {
+    Usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  try {
+    const AllocatorOptions &a = options.allocator;
+    std::cout << "{\"benchmark\": \"id-allocator-bench\", \"policy\": \""
+              << (a.policy == AllocationPolicy::BestFit    ? "best"
+                  : a.policy == AllocationPolicy::NextFit ? "next"
+                                                          : "first")
+              << "\", \"backend\": \""
+              << (a.backend == AllocatorBackend::Bitmap  ? "bitmap"
+                  : a.backend == AllocatorBackend::Buddy ? "buddy"
+                                                         : "extent")
+              << "\", \"mirror\": " << (a.mirror ? "true" : "false")
+              << ", \"packed\": " << (a.packed_extents ? "true" : "false")
+              << ", \"bump_tail\": " << (a.bump_tail ? "true" : "false")
+              << ", \"sync\": " << (options.sync ? "true" : "false")
+              << ", \"results\": [";
+    bool first = true;
+    for (size_t extents : options.extents) {
+      lmdb::env env = OpenEnv(options.path, options.sync);
+      Allocator allocator(env, options.allocator);
+      Fragment(env, allocator, extents);
+      for (size_t batch : options.batches) {
+        for (object_id_t len : options.lengths) {
+          for (const char *pattern : free_patterns) {
+            std::vector<id_extent_t> allocated;
+            BenchResult alloc = RunAllocate(env, allocator, options.ops,
+                                            std::max<size_t>(batch, 1), len,
+                                            allocated);
+            BenchResult free = RunFree(env, allocator,
+                                       std::max<size_t>(batch, 1), pattern,
+                                       std::move(allocated));
+            std::cout << (first ? "" : ",") << "\n  {\"extents\": " << extents
+                      << ", \"batch\": " << batch << ", \"length\": " << len
+                      << ", \"free_pattern\": \"" << pattern
+                      << "\", \"alloc\": ";
+            PrintResult(alloc);
+            std::cout << ", \"free\": ";
+            PrintResult(free);
+            std::cout << "}" << std::flush;
+            first = false;
+          }
+        }
+      }
+    }
+    std::cout << "\n]}" << std::endl;
+  } catch (const lmdb::error &e) {
+    std::cerr << "Failure: " << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,518 @@
+#include <allocator.h>
+#include <data_store.h>
+#include <index_store.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+//
+// Multi-process contention benchmark
+//
+// For every combination of the numbers of writers and readers, a fresh
+// environment is preloaded with objects, and that many processes are forked
+// against it. They open the environment on their own and start together once
+// all of them are ready.
+//
+// A writer allocates an ID per operation and stores data and an index entry
+// under it, freeing its oldest object again once it holds too many, and commits
+// every few operations. The time spent beginning a write transaction is the
+// time waited for the writer lock. A reader looks up random IDs and index
+// entries in read-only transactions.
+//
+// Every process reports its counts and latency histograms to the parent through
+// a pipe, and the aggregate results are written to stdout as JSON.
+//
+
+typedef std::chrono::steady_clock bench_clock;
+
+//
+// Options of a benchmark run
+//
+struct ContentionOptions {
+  // Directory of the environment
+  std::string path = "contention.mdb";
+  // Numbers of writer processes
+  std::vector<size_t> writers{1, 2, 4, 8};
+  // Numbers of reader processes
+  std::vector<size_t> readers{0, 1, 4, 16};
+  // Duration of every measurement in seconds
+  double duration = 5;
+  // Number of operations per transaction
+  size_t batch = 10;
+  // Number of objects created before the processes start
+  size_t preload = 10000;
+  // Number of objects a writer holds before freeing its oldest one
+  size_t live = 1000;
+  // Whether commits are synced to disk
+  bool sync = false;
+};
+
+//
+// Histogram of latencies
+//
+// A latency falls into one of #sub_buckets linear buckets within the power of
+// two holding it, so percentiles are accurate to 1/#sub_buckets while
+// histograms of any number of samples have the same size and merge by adding.
+//
+struct LatencyHistogram {
+  static constexpr size_t sub_buckets = 16;
+  static constexpr size_t buckets = 64 * sub_buckets;
+
+  // Record a latency of #ns nanoseconds
+  void Add(uint64_t ns) {
+    ++counts[Bucket(ns)];
+    ++count;
+    total += ns;
+    if (ns > max)
+      max = ns;
+  }
+
+  // Add the samples of #other
+  void Merge(const LatencyHistogram &other) {
+    for (size_t i = 0; i < buckets; ++i)
+      counts[i] += other.counts[i];
+    count += other.count;
+    total += other.total;
+    if (other.max > max)
+      max = other.max;
+  }
+
+  // Get the upper bound of the latencies below which #p of the samples lie
+  uint64_t Percentile(double p) const {
+    uint64_t rank = p * count, seen = 0;
+    for (size_t i = 0; i < buckets; ++i) {
+      seen += counts[i];
+      if (seen > rank)
+        return std::min(UpperBound(i), max);
+    }
+    return max;
+  }
+
+  // Number of samples
+  uint64_t count;
+  // Sum of the samples
+  uint64_t total;
+  // Largest sample
+  uint64_t max;
+  // Number of samples per bucket
+  uint64_t counts[buckets];
+
+private:
+  static size_t Bucket(uint64_t ns) {
+    if (ns < sub_buckets)
+      return ns;
+    size_t shift = 63 - __builtin_clzll(ns) - 4;
+    return (shift + 1) * sub_buckets + ((ns >> shift) - sub_buckets);
+  }
+
+  static uint64_t UpperBound(size_t bucket) {
+    if (bucket < sub_buckets)
+      return bucket;
+    size_t shift = bucket / sub_buckets - 1;
+    return ((sub_buckets + bucket % sub_buckets + 1) << shift) - 1;
+  }
+};
+
+//
+// Result reported by a process
+//
+struct ProcessResult {
+  // Number of operations
+  uint64_t ops;
+  // Number of transactions committed or finished
+  uint64_t txns;
+  // Latency of every operation
+  LatencyHistogram op_latency;
+  // Latency of every transaction, commit included
+  LatencyHistogram txn_latency;
+  // Time spent waiting to begin every write transaction
+  // Readers take no lock, so they leave it empty.
+  LatencyHistogram lock_wait;
+};
+
+//
+// Parse a comma separated list of numbers
+//
+static std::vector<size_t> ParseList(const char *arg) {
+  std::vector<size_t> list;
+  std::stringstream ss(arg);
+  std::string item;
+  while (std::getline(ss, item, ','))
+    list.push_back(std::strtoull(item.c_str(), nullptr, 0));
+  return list;
+}
+
+static void Usage(const char *prog) {
+  std::cerr << "Usage: " << prog
+            << " [--path DIR] [--writers N,...] [--readers N,...]"
+               " [--duration SECONDS] [--batch N] [--preload N] [--live N]"
+               " [--sync]"
+            << std::endl;
+}
+
+static bool ParseOptions(int argc, char *argv[], ContentionOptions &options) {
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--sync") {
+      options.sync = true;
+      continue;
+    }
+    if (i + 1 == argc)
+      return false;
+    const char *value = argv[++i];
+    if (arg == "--path")
+      options.path = value;
+    else if (arg == "--writers")
+      options.writers = ParseList(value);
+    else if (arg == "--readers")
+      options.readers = ParseList(value);
+    else if (arg == "--duration")
+      options.duration = std::strtod(value, nullptr);
+    else if (arg == "--batch")
+      options.batch = std::strtoull(value, nullptr, 0);
+    else if (arg == "--preload")
+      options.preload = std::strtoull(value, nullptr, 0);
+    else if (arg == "--live")
+      options.live = std::strtoull(value, nullptr, 0);
+    else
+      return false;
+  }
+  return options.duration > 0 && options.batch > 0;
+}
+
+//
+// Open the environment at #path
+//
+static lmdb::env OpenEnv(const std::string &path, bool sync) {
+  lmdb::env env = lmdb::env::create();
+  env.set_max_dbs(8);
+  env.set_mapsize(1ull * 1024 * 1024 * 1024 * 1024); // 1TiB max. mapsize
+  env.set_max_readers(1024);
+  env.open(path.c_str(), sync ? 0 : MDB_NOSYNC);
+  return env;
+}
+
+static std::string IndexOf(object_id_t id) {
+  return "object-" + std::to_string(id);
+}
+
+static uint64_t Nanoseconds(bench_clock::time_point start,
+                            bench_clock::time_point end) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+      .count();
+}
+
+//
+// Create an empty environment with #options.preload objects
+//
+static void Preload(const ContentionOptions &options) {
+  mkdir(options.path.c_str(), 0755);
+  std::remove((options.path + "/data.mdb").c_str());
+  std::remove((options.path + "/lock.mdb").c_str());
+  lmdb::env env = OpenEnv(options.path, options.sync);
+  Allocator allocator(env);
+  DataStore data_store(env, allocator);
+  IndexStore index_store(env, allocator);
+  lmdb::txn txn = lmdb::txn::begin(env);
+  for (size_t i = 0; i < options.preload; ++i) {
+    auto r = allocator.IdAllocate(txn, 1);
+    data_store.SetData(txn, r->first, std::string(64, 'p'));
+    index_store.SetIndex(txn, IndexOf(r->first), std::string(16, 'p'));
+  }
+  txn.commit();
+}
+
+//
+// Allocate, store and free objects until #deadline
+//
+static void RunWriter(lmdb::env &env, Allocator &allocator,
+                      DataStore &data_store, IndexStore &index_store,
+                      const ContentionOptions &options,
+                      bench_clock::time_point deadline,
+                      ProcessResult &result) {
+  std::deque<object_id_t> live;
+  const std::string data(64, 'w');
+
+  while (bench_clock::now() < deadline) {
+    auto begin = bench_clock::now();
+    lmdb::txn txn = lmdb::txn::begin(env);
+    auto locked = bench_clock::now();
+    result.lock_wait.Add(Nanoseconds(begin, locked));
+
+    std::vector<object_id_t> allocated;
+    size_t freed = 0;
+    for (size_t i = 0; i < options.batch; ++i) {
+      auto start = bench_clock::now();
+      auto r = allocator.IdAllocate(txn, 1);
+      if (!r)
+        break;
+      data_store.SetData(txn, r->first, data);
+      index_store.SetIndex(txn, IndexOf(r->first), data);
+      allocated.push_back(r->first);
+      // Only objects committed before this transaction are freed, so fewer
+      // than #batch may be held if #live is smaller
+      if (freed < live.size() &&
+          live.size() + allocated.size() > options.live + freed) {
+        object_id_t id = live[freed++];
+        index_store.DeleteIndex(txn, IndexOf(id));
+        data_store.DeleteData(txn, id);
+        allocator.IdFree(txn, id, 1);
+      }
+      result.op_latency.Add(Nanoseconds(start, bench_clock::now()));
+    }
+    txn.commit();
+    result.txn_latency.Add(Nanoseconds(locked, bench_clock::now()));
+
+    // Only committed changes are tracked
+    live.erase(live.begin(), live.begin() + freed);
+    live.insert(live.end(), allocated.begin(), allocated.end());
+    result.ops += allocated.size();
+    ++result.txns;
+  }
+}
+
+//
+// Look up random objects until #deadline
+//
+static void RunReader(lmdb::env &env, DataStore &data_store,
+                      IndexStore &index_store,
+                      const ContentionOptions &options,
+                      bench_clock::time_point deadline,
+                      ProcessResult &result) {
+  std::mt19937_64 rng(getpid());
+  std::uniform_int_distribution<object_id_t> ids(0, 2 * options.preload);
+  std::string data;
+
+  while (bench_clock::now() < deadline) {
+    auto begin = bench_clock::now();
+    lmdb::txn txn = lmdb::txn::begin(env, nullptr, MDB_RDONLY);
+    for (size_t i = 0; i < options.batch; ++i) {
+      auto start = bench_clock::now();
+      object_id_t id = ids(rng);
+      if (i % 2)
+        data_store.GetData(txn, id, data);
+      else
+        index_store.GetIndex(txn, IndexOf(id), data);
+      result.op_latency.Add(Nanoseconds(start, bench_clock::now()));
+    }
+    txn.abort();
+    result.txn_latency.Add(Nanoseconds(begin, bench_clock::now()));
+    result.ops += options.batch;
+    ++result.txns;
+  }
+}
+
+//
+// Body of a forked process, reporting to #report_fd
+//
+// Readiness is signalled by writing to #ready_fd, and the process starts once
+// #start_fd is closed by the parent. The stores are opened before that, so
+// their setup is not timed.
+//
+static int RunProcess(const ContentionOptions &options, bool writer,
+                      int ready_fd, int start_fd, int report_fd) {
+  ProcessResult result{};
+  try {
+    lmdb::env env = OpenEnv(options.path, options.sync);
+    Allocator allocator(env);
+    DataStore data_store(env, allocator);
+    IndexStore index_store(env, allocator);
+    char c = 0;
+    if (write(ready_fd, &c, 1) != 1 || read(start_fd, &c, 1) != 0)
+      return EXIT_FAILURE;
+
+    auto deadline = bench_clock::now() +
+                    std::chrono::duration_cast<bench_clock::duration>(
+                        std::chrono::duration<double>(options.duration));
+    if (writer)
+      RunWriter(env, allocator, data_store, index_store, options, deadline,
+                result);
+    else
+      RunReader(env, data_store, index_store, options, deadline, result);
+  } catch (const lmdb::error &e) {
+    std::cerr << "Failure: " << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  const char *p = reinterpret_cast<const char *>(&result);
+  for (size_t left = sizeof(ProcessResult); left;) {
+    ssize_t n = write(report_fd, p, left);
+    if (n <= 0)
+      return EXIT_FAILURE;
+    p += n;
+    left -= n;
+  }
+  return EXIT_SUCCESS;
+}
+
+//
+// Read the result of a process from #fd
+//
+static bool ReadResult(int fd, ProcessResult &result) {
+  char *p = reinterpret_cast<char *>(&result);
+  for (size_t left = sizeof(ProcessResult); left;) {
+    ssize_t n = read(fd, p, left);
+    if (n <= 0)
+      return false;
+    p += n;
+    left -= n;
+  }
+  return true;
+}
+
+//
+// Write #histogram as a JSON object
+//
+static void PrintHistogram(const LatencyHistogram &histogram) {
+  std::cout << "{\"p50\": " << histogram.Percentile(0.5)
+            << ", \"p90\": " << histogram.Percentile(0.9)
+            << ", \"p99\": " << histogram.Percentile(0.99)
+            << ", \"p999\": " << histogram.Percentile(0.999)
+            << ", \"max\": " << histogram.max << "}";
+}
+
+//
+// Write the aggregate of the results of one role as a JSON object
+//
+// Only writers wait for the writer lock, so the lock wait is left out for
+// readers.
+//
+static void PrintRole(const ProcessResult &result, double duration,
+                      bool writer) {
+  std::cout << "{\"ops\": " << result.ops << ", \"txns\": " << result.txns
+            << ", \"ops_per_sec\": " << result.ops / duration
+            << ", \"op_latency_ns\": ";
+  PrintHistogram(result.op_latency);
+  std::cout << ", \"txn_latency_ns\": ";
+  PrintHistogram(result.txn_latency);
+  if (writer) {
+    std::cout << ", \"lock_wait_seconds\": " << result.lock_wait.total / 1e9
+              << ", \"lock_wait_ns\": ";
+    PrintHistogram(result.lock_wait);
+  }
+  std::cout << "}";
+}
+
+//
+// Run #writers writer and #readers reader processes against a fresh
+// environment, aggregating their results into #writer_result/#reader_result
+//
+static bool RunRound(const ContentionOptions &options, size_t writers,
+                     size_t readers, ProcessResult &writer_result,
+                     ProcessResult &reader_result) {
+  Preload(options);
+
+  int ready[2], start[2];
+  if (pipe(ready) || pipe(start))
+    return false;
+  std::vector<pid_t> pids;
+  std::vector<int> reports;
+  for (size_t i = 0; i < writers + readers; ++i) {
+    int report[2];
+    if (pipe(report))
+      return false;
+    pid_t pid = fork();
+    if (pid < 0)
+      return false;
+    if (!pid) {
+      close(ready[0]);
+      close(start[1]);
+      close(report[0]);
+      _exit(RunProcess(options, i < writers, ready[1], start[0], report[1]));
+    }
+    close(report[1]);
+    pids.push_back(pid);
+    reports.push_back(report[0]);
+  }
+  close(ready[1]);
+  close(start[0]);
+
+  // Start every process at once
+  char c;
+  for (size_t i = 0; i < pids.size(); ++i)
+    if (read(ready[0], &c, 1) != 1)
+      break;
+  close(ready[0]);
+  close(start[1]);
+
+  bool ok = true;
+  ProcessResult result;
+  for (size_t i = 0; i < pids.size(); ++i) {
+    if (ReadResult(reports[i], result)) {
+      ProcessResult &total = i < writers ? writer_result : reader_result;
+      total.ops += result.ops;
+      total.txns += result.txns;
+      total.op_latency.Merge(result.op_latency);
+      total.txn_latency.Merge(result.txn_latency);
+      total.lock_wait.Merge(result.lock_wait);
+    } else {
+      ok = false;
+    }
+    close(reports[i]);
+  }
+  for (pid_t pid : pids) {
+    int status;
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != EXIT_SUCCESS)
+      ok = false;
+  }
+  return ok;
+}
+
+int main(int argc, char *argv[]) {
+  ContentionOptions options;
+  if (!ParseOptions(argc, argv, options)) {
+    Usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  try {
+    std::cout << "{\"benchmark\": \"id-allocator-contention-bench\", "
+                 "\"duration\": "
+              << options.duration << ", \"batch\": " << options.batch
+              << ", \"preload\": " << options.preload
+              << ", \"live\": " << options.live
+              << ", \"sync\": " << (options.sync ? "true" : "false")
+              << ", \"results\": [";
+    bool first = true;
+    for (size_t writers : options.writers) {
+      for (size_t readers : options.readers) {
+        if (!writers && !readers)
+          continue;
+        ProcessResult writer_result{}, reader_result{};
+        if (!RunRound(options, writers, readers, writer_result,
+                      reader_result)) {
+          std::cerr << "Failure: a process of " << writers << " writers and "
+                    << readers << " readers failed" << std::endl;
+          return EXIT_FAILURE;
+        }
+        std::cout << (first ? "" : ",") << "\n  {\"writers\": " << writers
+                  << ", \"readers\": " << readers << ", \"writer\": ";
+        PrintRole(writer_result, options.duration, true);
+        std::cout << ", \"reader\": ";
+        PrintRole(reader_result, options.duration, false);
+        std::cout << "}" << std::flush;
+        first = false;
+      }
+    }
+    std::cout << "\n]}" << std::endl;
+  } catch (const lmdb::error &e) {
+    std::cerr << "Failure: " << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -1,51 +1,103 @@
 #include "data_store.h"
 
 #include <iostream>
+#include <vector>
+
+#include "index_store.h"
 
 // Name of the database
 static const char* database_name = "DataStore";
 
-DataStore::DataStore(lmdb::env& env, Allocator& allocator) try
+template <typename Id>
+BasicDataStore<Id>::BasicDataStore(lmdb::env& env,
+                                   BasicAllocator<Id>& allocator) try
     : dbi(0),
       allocator(allocator) {
   lmdb::txn txn = lmdb::txn::begin(env);
-  dbi = lmdb::dbi::open(txn, database_name, MDB_CREATE | MDB_INTEGERKEY);
+  dbi = lmdb::dbi::open(txn, database_name,
+                        MDB_CREATE | IdTraits<Id>::KeyFlags());
   txn.commit();
 } catch (const lmdb::error& e) {
   std::cout << e.what();
   throw;
 }
 
-DataStore::~DataStore() noexcept {}
+template <typename Id>
+BasicDataStore<Id>::~BasicDataStore() noexcept {}
 
-bool DataStore::IdExist(lmdb::txn& txn, object_id_t id) {
-  lmdb::val val_id(&id, sizeof(object_id_t));
+template <typename Id>
+bool BasicDataStore<Id>::IdExist(lmdb::txn& txn, object_id_t id) {
+  IdKey<Id> key(id);
+  lmdb::val val_id = key.val();
   lmdb::cursor cursor = lmdb::cursor::open(txn, dbi);
   if (!cursor.get(val_id, MDB_SET))
     return false;
   return true;
 }
 
-bool DataStore::GetData(lmdb::txn& txn, object_id_t id, std::string& data) {
-  lmdb::val val_id(&id, sizeof(object_id_t)), val_data;
-  lmdb::cursor cursor = lmdb::cursor::open(txn, dbi);
-  if (!cursor.get(val_id, MDB_SET_KEY))
+template <typename Id>
+bool BasicDataStore<Id>::GetData(lmdb::txn& txn,
+                                 object_id_t id,
+                                 std::string& data) {
+  lmdb::val val_data;
+  if (!GetData(txn, id, val_data))
     return false;
-  data.assign(val_id.data(), val_id.size());
+  data.assign(val_data.data(), val_data.size());
   return true;
 }
 
-void DataStore::SetData(lmdb::txn &txn, object_id_t id, const std::string &data) {
-  lmdb::val val_id(&id, sizeof(object_id_t));
+template <typename Id>
+bool BasicDataStore<Id>::GetData(lmdb::txn& txn,
+                                 object_id_t id,
+                                 lmdb::val& data) {
+  IdKey<Id> key(id);
+  return dbi.get(txn, key.val(), data);
+}
+
+template <typename Id>
+void BasicDataStore<Id>::SetData(lmdb::txn &txn, object_id_t id, const std::string &data) {
+  IdKey<Id> key(id);
+  lmdb::val val_id = key.val();
   lmdb::val val_data(data);
   lmdb::cursor cursor = lmdb::cursor::open(txn, dbi);
   cursor.put(val_id, val_data, 0);
 }
 
-void DataStore::DeleteData(lmdb::txn &txn, object_id_t id) {
-  lmdb::val val_id(&id, sizeof(object_id_t));
+template <typename Id>
+void BasicDataStore<Id>::DeleteData(lmdb::txn &txn, object_id_t id) {
+  IdKey<Id> key(id);
+  lmdb::val val_id = key.val();
   lmdb::cursor cursor = lmdb::cursor::open(txn, dbi);
   if (!cursor.get(val_id, MDB_SET))
     return;
   cursor.del();
-}
\ No newline at end of file
+}
+
+//
+// Rebuild the free IDs of the allocator from the IDs in the data store
+//
+// The keys of the data store are streamed in order in the same write
+// transaction that replaces the free IDs, so they are consistent. The index
+// entries of the index store take their IDs from the allocator as well, so
+// they are kept allocated too.
+//
+template <typename Id>
+uint64_t BasicDataStore<Id>::RebuildAllocator(
+    lmdb::env& env,
+    const BasicAllocatorOptions<Id>& options) {
+  lmdb::txn txn = lmdb::txn::begin(env);
+  lmdb::dbi dbi = lmdb::dbi::open(txn, database_name,
+                                  MDB_CREATE | IdTraits<Id>::KeyFlags());
+  std::vector<uint64_t> entry_ids;
+  IndexStore::EntryIds(txn, entry_ids);
+  uint64_t extents = BasicAllocator<Id>::RebuildFromLiveIds(
+      txn, dbi, std::vector<Id>(entry_ids.begin(), entry_ids.end()), options);
+  txn.commit();
+  return extents;
+}
+
+template struct BasicDataStore<uint32_t>;
+template struct BasicDataStore<uint64_t>;
+#ifdef __SIZEOF_INT128__
+template struct BasicDataStore<uint128_t>;
+#endif
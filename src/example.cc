@@ -11,7 +11,7 @@ int main() {
   lmdb::env env = lmdb::env::create();
   try {
     std::set<object_id_t> got_ids;
-    env.set_max_dbs(3);
+    env.set_max_dbs(8);
     env.set_mapsize(1ull * 1024 * 1024 * 1024 * 1024); // 1TiB max. mapsize
     env.open("example.mdb");
 
@@ -0,0 +1,400 @@
+#include "free_extent_mirror.h"
+
+#include <algorithm>
+#include <cassert>
+
+//
+// Maximal number of extents in a chunk
+//
+// A chunk is split in halves when it grows past this, and merged into the
+// chunk following it when it shrinks below a quarter of this.
+//
+static constexpr size_t chunk_size = 256;
+
+//
+// Check if two generations are the same
+//
+static inline bool SameGeneration(const FreeExtentGeneration &a,
+                                  const FreeExtentGeneration &b) {
+  return a.generation == b.generation && a.writer == b.writer;
+}
+
+//
+// Generation of a mirror changed since the last generation was recorded
+//
+// It is never stored in the database, so changes left behind by an update that
+// failed half way are undone by the next Sync().
+//
+static const FreeExtentGeneration changing_generation{UINT64_MAX, 0};
+
+//
+// Load the mirror from #cursor
+//
+template <typename Id>
+void FreeExtentMirror<Id>::Load(ExtentCursor<Id> &cursor,
+                                const FreeExtentGeneration &generation) {
+  chunks.clear();
+  by_length.clear();
+  changes.clear();
+  FreeIdExtent ext;
+  for (bool found = cursor.First(ext); found; found = cursor.Next(ext)) {
+    if (chunks.empty() || chunks.back().size() == chunk_size / 2)
+      chunks.emplace_back();
+    chunks.back().push_back(ext);
+    by_length.insert({ext.length, ext.id});
+  }
+  this->generation = generation;
+  txn_id = 0;
+}
+
+//
+// Sync the mirror with the database as seen by #txn
+//
+// An aborted write transaction leaves its ID to the next write transaction, so
+// the logged changes of aborted transactions are those made with an ID not less
+// than the one of #txn. They are undone newest first until the mirror is back
+// at the generation in the database.
+//
+template <typename Id>
+bool FreeExtentMirror<Id>::Sync(lmdb::txn &txn,
+                                const FreeExtentGeneration &generation) {
+  size_t id = mdb_txn_id(txn);
+  while (!SameGeneration(this->generation, generation) && !changes.empty() &&
+         changes.back().txn_id >= id) {
+    const Change &change = changes.back();
+    if (change.inserted) {
+      Position pos;
+      LowerBound(change.ext.id, pos);
+      DoErase(pos);
+    } else {
+      DoInsert(change.ext);
+    }
+    this->generation = change.generation;
+    changes.pop_back();
+  }
+  if (!SameGeneration(this->generation, generation))
+    return false;
+
+  // Changes of older transactions are committed
+  auto it = std::find_if(changes.begin(), changes.end(),
+                         [id](const Change &c) { return c.txn_id >= id; });
+  changes.erase(changes.begin(), it);
+  txn_id = id;
+  return true;
+}
+
+//
+// Record the generation written for the changes made since Sync()
+//
+template <typename Id>
+void
+FreeExtentMirror<Id>::SetGeneration(const FreeExtentGeneration &generation) {
+  this->generation = generation;
+}
+
+template <typename Id>
+bool FreeExtentMirror<Id>::First(Position &pos) const {
+  pos = {0, 0};
+  return Valid(pos);
+}
+
+template <typename Id>
+bool FreeExtentMirror<Id>::Last(Position &pos) const {
+  if (chunks.empty())
+    return false;
+  pos = {chunks.size() - 1, chunks.back().size() - 1};
+  return true;
+}
+
+template <typename Id>
+bool FreeExtentMirror<Id>::Next(Position &pos) const {
+  if (!Valid(pos))
+    return false;
+  if (++pos.index == chunks[pos.chunk].size()) {
+    ++pos.chunk;
+    pos.index = 0;
+  }
+  return Valid(pos);
+}
+
+template <typename Id>
+bool FreeExtentMirror<Id>::Prev(Position &pos) const {
+  if (Valid(pos) && pos.index) {
+    --pos.index;
+    return true;
+  }
+  if (!pos.chunk)
+    return false;
+  pos.chunk = std::min(pos.chunk, chunks.size()) - 1;
+  pos.index = chunks[pos.chunk].size() - 1;
+  return true;
+}
+
+//
+// Move to the first extent starting at or after #id
+//
+// If there is none, #pos is left past the last extent.
+//
+template <typename Id>
+bool FreeExtentMirror<Id>::LowerBound(Id id, Position &pos) const {
+  auto chunk = std::lower_bound(
+      chunks.begin(), chunks.end(), id,
+      [](const std::vector<FreeIdExtent> &c, Id id) {
+        return c.back().id < id;
+      });
+  pos = {static_cast<size_t>(chunk - chunks.begin()), 0};
+  if (chunk == chunks.end())
+    return false;
+  pos.index = std::lower_bound(chunk->begin(), chunk->end(), id,
+                               [](const FreeIdExtent &e, Id id) {
+                                 return e.id < id;
+                               }) -
+              chunk->begin();
+  return true;
+}
+
+template <typename Id>
+bool FreeExtentMirror<Id>::Valid(const Position &pos) const {
+  return pos.chunk < chunks.size();
+}
+
+template <typename Id>
+const BasicFreeIdExtent<Id> &
+FreeExtentMirror<Id>::At(const Position &pos) const {
+  assert(Valid(pos));
+  return chunks[pos.chunk][pos.index];
+}
+
+//
+// Find the shortest extent holding at least #len IDs
+//
+// Among extents of the same length the one with the lowest ID is chosen.
+//
+template <typename Id>
+bool FreeExtentMirror<Id>::BestFit(Id len, FreeIdExtent &ext) const {
+  auto it = by_length.lower_bound({len, 0});
+  if (it == by_length.end())
+    return false;
+  ext = {it->second, it->first};
+  return true;
+}
+
+template <typename Id>
+bool FreeExtentMirror<Id>::AlignedFit(Id len, Id align,
+                                      FreeIdExtent &ext) const {
+  Id id;
+  for (auto it = by_length.lower_bound({len, 0}); it != by_length.end(); ++it) {
+    ext = {it->second, it->first};
+    if (AlignedWindow(ext, len, align, id))
+      return true;
+  }
+  return false;
+}
+
+template <typename Id>
+bool FreeExtentMirror<Id>::Longest(FreeIdExtent &ext) const {
+  if (by_length.empty())
+    return false;
+  ext = {by_length.rbegin()->second, by_length.rbegin()->first};
+  return true;
+}
+
+template <typename Id>
+typename FreeExtentMirror<Id>::Position
+FreeExtentMirror<Id>::Insert(const FreeIdExtent &ext) {
+  changes.push_back({txn_id, generation, true, ext});
+  generation = changing_generation;
+  return DoInsert(ext);
+}
+
+template <typename Id>
+typename FreeExtentMirror<Id>::Position
+FreeExtentMirror<Id>::Erase(const Position &pos) {
+  changes.push_back({txn_id, generation, false, At(pos)});
+  generation = changing_generation;
+  return DoErase(pos);
+}
+
+//
+// Replace the extent at #pos with #ext
+//
+// As extents do not overlap, #ext sorts where the old extent did, so only the
+// index by length has to be updated. The change is logged as a removal and an
+// insertion.
+//
+template <typename Id>
+void FreeExtentMirror<Id>::Replace(const Position &pos,
+                                   const FreeIdExtent &ext) {
+  FreeIdExtent &old = chunks[pos.chunk][pos.index];
+  changes.push_back({txn_id, generation, false, old});
+  changes.push_back({txn_id, changing_generation, true, ext});
+  generation = changing_generation;
+  by_length.erase({old.length, old.id});
+  by_length.insert({ext.length, ext.id});
+  old = ext;
+}
+
+template <typename Id>
+typename FreeExtentMirror<Id>::Position
+FreeExtentMirror<Id>::DoInsert(const FreeIdExtent &ext) {
+  by_length.insert({ext.length, ext.id});
+  if (chunks.empty()) {
+    chunks.emplace_back(1, ext);
+    return {0, 0};
+  }
+
+  // An extent beyond every chunk is appended to the last one
+  Position pos;
+  if (!LowerBound(ext.id, pos))
+    pos = {chunks.size() - 1, chunks.back().size()};
+  std::vector<FreeIdExtent> &chunk = chunks[pos.chunk];
+  chunk.insert(chunk.begin() + pos.index, ext);
+  if (chunk.size() > chunk_size) {
+    size_t half = chunk.size() / 2;
+    std::vector<FreeIdExtent> upper(chunk.begin() + half, chunk.end());
+    chunk.resize(half);
+    chunks.insert(chunks.begin() + pos.chunk + 1, std::move(upper));
+    if (pos.index >= half) {
+      ++pos.chunk;
+      pos.index -= half;
+    }
+  }
+  return pos;
+}
+
+template <typename Id>
+typename FreeExtentMirror<Id>::Position
+FreeExtentMirror<Id>::DoErase(const Position &pos) {
+  std::vector<FreeIdExtent> &chunk = chunks[pos.chunk];
+  by_length.erase({chunk[pos.index].length, chunk[pos.index].id});
+  chunk.erase(chunk.begin() + pos.index);
+  if (chunk.empty()) {
+    chunks.erase(chunks.begin() + pos.chunk);
+    return {pos.chunk, 0};
+  }
+
+  if (chunk.size() < chunk_size / 4 && pos.chunk + 1 < chunks.size() &&
+      chunk.size() + chunks[pos.chunk + 1].size() <= chunk_size) {
+    std::vector<FreeIdExtent> &following = chunks[pos.chunk + 1];
+    chunk.insert(chunk.end(), following.begin(), following.end());
+    chunks.erase(chunks.begin() + pos.chunk + 1);
+  }
+  if (pos.index == chunk.size())
+    return {pos.chunk + 1, 0};
+  return pos;
+}
+
+template <typename Id>
+MirrorExtentCursor<Id>::MirrorExtentCursor(FreeExtentMirror<Id> &mirror,
+                                           lmdb::txn &txn, lmdb::dbi &dbi)
+    : mirror(mirror), txn(txn), dbi(dbi), pos{0, 0}, erased(false) {}
+
+template <typename Id>
+bool MirrorExtentCursor<Id>::Get(bool found, FreeIdExtent &ext) {
+  erased = false;
+  if (found)
+    ext = mirror.At(pos);
+  return found;
+}
+
+template <typename Id>
+bool MirrorExtentCursor<Id>::First(FreeIdExtent &ext) {
+  return Get(mirror.First(pos), ext);
+}
+
+template <typename Id>
+bool MirrorExtentCursor<Id>::Last(FreeIdExtent &ext) {
+  return Get(mirror.Last(pos), ext);
+}
+
+template <typename Id>
+bool MirrorExtentCursor<Id>::Next(FreeIdExtent &ext) {
+  // The extent following an erased one is already at the current position
+  if (erased)
+    return Get(mirror.Valid(pos), ext);
+  return Get(mirror.Next(pos), ext);
+}
+
+template <typename Id>
+bool MirrorExtentCursor<Id>::Prev(FreeIdExtent &ext) {
+  return Get(mirror.Prev(pos), ext);
+}
+
+template <typename Id>
+bool MirrorExtentCursor<Id>::Seek(Id id, FreeIdExtent &ext) {
+  return Get(mirror.LowerBound(id, pos) && mirror.At(pos).id == id, ext);
+}
+
+template <typename Id>
+bool MirrorExtentCursor<Id>::SeekRange(Id id, FreeIdExtent &ext) {
+  return Get(mirror.LowerBound(id, pos), ext);
+}
+
+//
+// Move to the first extent ending at or after #id
+//
+// Only the extent before the first one starting at or after #id may hold #id
+// without starting at it.
+//
+template <typename Id>
+bool MirrorExtentCursor<Id>::SeekEnd(Id id, FreeIdExtent &ext) {
+  if (mirror.LowerBound(id, pos) && mirror.At(pos).id == id)
+    return Get(true, ext);
+  typename FreeExtentMirror<Id>::Position prev = pos;
+  if (mirror.Prev(prev) && ExtentKey(mirror.At(prev)) >= id) {
+    pos = prev;
+    return Get(true, ext);
+  }
+  return Get(mirror.Valid(pos), ext);
+}
+
+//
+// Remove the extent at the cursor
+//
+// The free extent database is keyed by the last ID of an extent, so the extent
+// is removed from it without a cursor.
+//
+template <typename Id>
+void MirrorExtentCursor<Id>::Erase() {
+  IdKey<Id> last_id(ExtentKey(mirror.At(pos)));
+  dbi.del(txn, last_id.val());
+  pos = mirror.Erase(pos);
+  erased = true;
+}
+
+template <typename Id>
+void MirrorExtentCursor<Id>::Insert(const FreeIdExtent &ext) {
+  IdKey<Id> last_id(ExtentKey(ext)), length(ext.length);
+  lmdb::val key = last_id.val(), data = length.val();
+  dbi.put(txn, key, data);
+  pos = mirror.Insert(ext);
+  erased = false;
+}
+
+//
+// Replace the extent #old at the cursor with #ext
+//
+// Putting an extent with the last ID of #old overwrites its length in place.
+//
+template <typename Id>
+void MirrorExtentCursor<Id>::Replace(const FreeIdExtent &old,
+                                     const FreeIdExtent &ext) {
+  IdKey<Id> last_id(ExtentKey(ext)), length(ext.length);
+  lmdb::val key = last_id.val(), data = length.val();
+  if (ExtentKey(old) != ExtentKey(ext)) {
+    IdKey<Id> old_last_id(ExtentKey(old));
+    dbi.del(txn, old_last_id.val());
+  }
+  dbi.put(txn, key, data);
+  mirror.Replace(pos, ext);
+  erased = false;
+}
+
+template struct FreeExtentMirror<uint32_t>;
+template struct FreeExtentMirror<uint64_t>;
+template struct MirrorExtentCursor<uint32_t>;
+template struct MirrorExtentCursor<uint64_t>;
+#ifdef __SIZEOF_INT128__
+template struct FreeExtentMirror<uint128_t>;
+template struct MirrorExtentCursor<uint128_t>;
+#endif
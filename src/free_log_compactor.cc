@@ -0,0 +1,66 @@
+#include "free_log_compactor.h"
+
+#include <iostream>
+
+//
+// Start compacting the free log of #allocator
+//
+FreeLogCompactor::FreeLogCompactor(lmdb::env &env, Allocator &allocator,
+                                   std::chrono::milliseconds interval,
+                                   size_t batch_size)
+    : env(env),
+      allocator(allocator),
+      interval(interval),
+      batch_size(batch_size),
+      stopping(false),
+      woken(false),
+      thread(&FreeLogCompactor::Run, this) {}
+
+//
+// Stop compacting
+//
+FreeLogCompactor::~FreeLogCompactor() noexcept {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  cond.notify_one();
+  thread.join();
+}
+
+void FreeLogCompactor::Wake() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    woken = true;
+  }
+  cond.notify_one();
+}
+
+//
+// Body of the compactor thread
+//
+// Each batch is merged in a write transaction of its own, so allocations get
+// the write lock in between batches.
+//
+void FreeLogCompactor::Run() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (!stopping) {
+    cond.wait_for(lock, interval, [this] { return stopping || woken; });
+    if (stopping)
+      break;
+    woken = false;
+    lock.unlock();
+
+    try {
+      size_t merged;
+      do {
+        lmdb::txn txn = lmdb::txn::begin(env);
+        merged = allocator.CompactFreeLog(txn, batch_size);
+        txn.commit();
+      } while (merged == batch_size);
+    } catch (const lmdb::error &e) {
+      std::cout << e.what();
+    }
+    lock.lock();
+  }
+}
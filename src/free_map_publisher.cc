@@ -0,0 +1,78 @@
+#include "free_map_publisher.h"
+
+#include <iostream>
+#include <system_error>
+
+//
+// Start publishing snapshots of the free IDs of #allocator to #path
+//
+FreeMapPublisher::FreeMapPublisher(lmdb::env &env, Allocator &allocator,
+                                   const std::string &path,
+                                   std::chrono::milliseconds interval)
+    : env(env),
+      allocator(allocator),
+      path(path),
+      interval(interval),
+      version{0, 0, 0},
+      published(false),
+      stopping(false),
+      woken(false),
+      thread(&FreeMapPublisher::Run, this) {}
+
+//
+// Stop publishing
+//
+FreeMapPublisher::~FreeMapPublisher() noexcept {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  cond.notify_one();
+  thread.join();
+}
+
+void FreeMapPublisher::Wake() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    woken = true;
+  }
+  cond.notify_one();
+}
+
+//
+// Body of the publisher thread
+//
+// A snapshot is published right away, so that readers have one as soon as the
+// publisher is started.
+//
+void FreeMapPublisher::Run() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (!stopping) {
+    lock.unlock();
+    Publish();
+    lock.lock();
+
+    cond.wait_for(lock, interval, [this] { return stopping || woken; });
+    woken = false;
+  }
+}
+
+//
+// Publish a snapshot if the free IDs changed since the last one
+//
+void FreeMapPublisher::Publish() {
+  try {
+    lmdb::txn txn = lmdb::txn::begin(env, nullptr, MDB_RDONLY);
+    FreeMapSnapshotVersion current = allocator.SnapshotVersion(txn);
+    if (!published || current != version) {
+      allocator.PublishSnapshot(txn, path);
+      version = current;
+      published = true;
+    }
+    txn.abort();
+  } catch (const lmdb::error &e) {
+    std::cout << e.what();
+  } catch (const std::system_error &e) {
+    std::cout << e.what();
+  }
+}
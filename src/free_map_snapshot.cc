@@ -0,0 +1,129 @@
+#include "free_map_snapshot.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+template <typename Id>
+BasicFreeMapSnapshot<Id>::BasicFreeMapSnapshot()
+    : device(0), inode(0), map(nullptr), length(0), header(nullptr),
+      extents(nullptr), count(0) {}
+
+template <typename Id>
+BasicFreeMapSnapshot<Id>::~BasicFreeMapSnapshot() noexcept {
+  Close();
+}
+
+//
+// Map the snapshot at #path instead of the current one
+//
+// The file is checked to be a whole snapshot of IDs of this width before the
+// current snapshot is unmapped.
+//
+template <typename Id>
+bool BasicFreeMapSnapshot<Id>::Open(const std::string &path) {
+  this->path = path;
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  void *new_map = MAP_FAILED;
+  if (!::fstat(fd, &st) && size_t(st.st_size) >= sizeof(FreeMapSnapshotHeader))
+    new_map = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (new_map == MAP_FAILED)
+    return false;
+
+  const FreeMapSnapshotHeader *new_header =
+      static_cast<const FreeMapSnapshotHeader *>(new_map);
+  if (std::memcmp(new_header->magic, free_map_snapshot_magic,
+                  sizeof(new_header->magic)) ||
+      new_header->format != free_map_snapshot_format ||
+      new_header->id_width != sizeof(Id) ||
+      new_header->count > (st.st_size - sizeof(FreeMapSnapshotHeader)) /
+                              sizeof(Extent)) {
+    ::munmap(new_map, st.st_size);
+    return false;
+  }
+
+  Close();
+  device = st.st_dev;
+  inode = st.st_ino;
+  map = new_map;
+  length = st.st_size;
+  header = new_header;
+  extents = reinterpret_cast<const Extent *>(new_header + 1);
+  count = new_header->count;
+  return true;
+}
+
+//
+// Map the snapshot again if the file was replaced
+//
+// A new snapshot is renamed over the old one, so the file was replaced if its
+// path names another inode.
+//
+template <typename Id> bool BasicFreeMapSnapshot<Id>::Refresh() {
+  struct stat st;
+  if (path.empty() || ::stat(path.c_str(), &st))
+    return false;
+  if (map && st.st_dev == device && st.st_ino == inode)
+    return false;
+  return Open(path);
+}
+
+template <typename Id> void BasicFreeMapSnapshot<Id>::Close() {
+  if (map)
+    ::munmap(map, length);
+  device = 0;
+  inode = 0;
+  map = nullptr;
+  length = 0;
+  header = nullptr;
+  extents = nullptr;
+  count = 0;
+}
+
+//
+// Find the first extent holding #id or starting after it
+//
+// The extents are disjoint and sorted by ID, so they are sorted by their last
+// ID as well.
+//
+template <typename Id>
+const typename BasicFreeMapSnapshot<Id>::Extent *
+BasicFreeMapSnapshot<Id>::Find(Id id) const {
+  return std::lower_bound(extents, extents + count, id,
+                          [](const Extent &ext, Id id) {
+                            return ext.id + (ext.length - 1) < id;
+                          });
+}
+
+template <typename Id> bool BasicFreeMapSnapshot<Id>::IsFree(Id id) const {
+  const Extent *it = Find(id);
+  return it != extents + count && it->id <= id;
+}
+
+template <typename Id>
+bool BasicFreeMapSnapshot<Id>::NextFree(Id id, Extent &ext) const {
+  const Extent *it = Find(id);
+  if (it == extents + count)
+    return false;
+  ext = *it;
+  if (ext.id < id) {
+    ext.length -= id - ext.id;
+    ext.id = id;
+  }
+  return true;
+}
+
+template struct BasicFreeMapSnapshot<uint32_t>;
+template struct BasicFreeMapSnapshot<uint64_t>;
+#ifdef __SIZEOF_INT128__
+template struct BasicFreeMapSnapshot<unsigned __int128>;
+#endif
@@ -0,0 +1,109 @@
+#include "id_bitmap.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+//
+// Mask of #n bits starting at bit #off of a word
+//
+static inline uint64_t BitMask(uint64_t off, uint64_t n) {
+  return (n == 64 ? ~0ull : (1ull << n) - 1) << off;
+}
+
+void IdBitmap::Clear() {
+  free_count = 0;
+  std::memset(summary, 0, sizeof(summary));
+  std::memset(leaf, 0, sizeof(leaf));
+}
+
+//
+// Find the first free ID
+//
+bool IdBitmap::FindFree(uint64_t &bit) const {
+  for (size_t i = 0; i < leaf_words / 64; ++i) {
+    if (!summary[i])
+      continue;
+    size_t word = i * 64 + __builtin_ctzll(summary[i]);
+    bit = word * 64 + __builtin_ctzll(leaf[word]);
+    return true;
+  }
+  return false;
+}
+
+//
+// Find the first free ID at or after #from
+//
+// The word holding #from is masked below it, and the summary is scanned from
+// the word following it.
+//
+bool IdBitmap::FindFree(uint64_t from, uint64_t &bit) const {
+  if (from >= bits)
+    return false;
+  size_t word = from / 64;
+  uint64_t rest = leaf[word] & ~BitMask(0, from % 64);
+  if (rest) {
+    bit = word * 64 + __builtin_ctzll(rest);
+    return true;
+  }
+  for (size_t i = (word + 1) / 64; i < leaf_words / 64; ++i) {
+    uint64_t words = summary[i];
+    if (i == (word + 1) / 64)
+      words &= ~BitMask(0, (word + 1) % 64);
+    if (!words)
+      continue;
+    size_t next = i * 64 + __builtin_ctzll(words);
+    bit = next * 64 + __builtin_ctzll(leaf[next]);
+    return true;
+  }
+  return false;
+}
+
+//
+// Mark up to #len consecutive free IDs starting at #bit as used
+//
+// The run is followed word by word: the free bits from the current position
+// are counted up to the first used one, and the walk goes on into the next word
+// only if the run reaches the end of this one.
+//
+uint64_t IdBitmap::Take(uint64_t bit, uint64_t len) {
+  uint64_t taken = 0;
+  while (taken < len && bit < bits) {
+    size_t word = bit / 64;
+    uint64_t off = bit % 64;
+    uint64_t used = ~leaf[word] >> off;
+    uint64_t n = used ? __builtin_ctzll(used) : 64 - off;
+    n = std::min(n, len - taken);
+    if (!n)
+      break;
+    leaf[word] &= ~BitMask(off, n);
+    if (!leaf[word])
+      summary[word / 64] &= ~(1ull << word % 64);
+    taken += n;
+    bit += n;
+    if (off + n < 64)
+      break;
+  }
+  free_count -= taken;
+  return taken;
+}
+
+//
+// Mark the #len IDs starting at #bit as free
+//
+void IdBitmap::Release(uint64_t bit, uint64_t len) {
+  assert(bit + len <= bits);
+  while (len) {
+    size_t word = bit / 64;
+    uint64_t off = bit % 64;
+    uint64_t n = std::min(len, 64 - off);
+    uint64_t mask = BitMask(off, n);
+    // Double free of an ID is prohibited
+    assert(!(leaf[word] & mask));
+    free_count += __builtin_popcountll(mask & ~leaf[word]);
+    leaf[word] |= mask;
+    summary[word / 64] |= 1ull << word % 64;
+    bit += n;
+    len -= n;
+  }
+}
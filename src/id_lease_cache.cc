@@ -0,0 +1,238 @@
+#include "id_lease_cache.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <iostream>
+#include <set>
+
+// Name of the database
+static const char *database_name = "AllocatorLease";
+
+// Serial number of the next lease cache
+static std::atomic<uint64_t> next_serial(0);
+// Serial numbers of the lease caches alive, protected by #live_mutex
+static std::set<uint64_t> live_serials;
+static std::mutex live_mutex;
+// Number of lease caches destroyed
+static std::atomic<uint64_t> destroyed(0);
+
+thread_local std::vector<std::pair<uint64_t, IdLeaseCache::Lease *>>
+    IdLeaseCache::lease_slots;
+thread_local uint64_t IdLeaseCache::lease_slots_pruned = 0;
+
+//
+// Record of a lease in the database, keyed by its starting ID
+//
+// Records written before the high-water mark was kept hold the length alone.
+//
+struct LeaseRecord {
+  // Number of IDs of the lease
+  object_id_t length;
+  // No ID at or past this one was handed out
+  object_id_t limit;
+};
+
+//
+// Range of IDs leased to a thread
+//
+// Only the owning thread advances #next, so handing out IDs needs no
+// synchronization.
+//
+struct IdLeaseCache::Lease {
+  // Starting ID of the lease, which is also the key of its record
+  object_id_t id;
+  // Next ID to hand out
+  object_id_t next;
+  // High-water mark in the record of the lease
+  object_id_t limit;
+  // One past the last ID of the lease
+  object_id_t end;
+};
+
+//
+// Open/create the lease cache in the environment
+//
+IdLeaseCache::IdLeaseCache(lmdb::env &env, Allocator &allocator,
+                           object_id_t lease_size,
+                           const liveness_t &is_live,
+                           object_id_t limit_step) try
+    : env(env),
+      allocator(allocator),
+      dbi(0),
+      lease_size(lease_size),
+      limit_step(limit_step ? limit_step : lease_size),
+      serial(next_serial++) {
+  lmdb::txn txn = lmdb::txn::begin(env);
+  dbi = lmdb::dbi::open(txn, database_name, MDB_CREATE | MDB_INTEGERKEY);
+  RecoverLeases(txn, is_live);
+  txn.commit();
+  std::lock_guard<std::mutex> lock(live_mutex);
+  live_serials.insert(serial);
+} catch (const lmdb::error &e) {
+  std::cout << e.what();
+  throw;
+}
+
+//
+// Return the unused remainder of every lease to the allocator
+//
+// If this fails the lease records stay behind, and the leases are recovered by
+// the next instance as if we had crashed.
+//
+// The slots threads keep for this cache are dropped by the threads themselves
+// the next time they allocate from any cache.
+//
+IdLeaseCache::~IdLeaseCache() noexcept {
+  {
+    std::lock_guard<std::mutex> lock(live_mutex);
+    live_serials.erase(serial);
+  }
+  ++destroyed;
+  try {
+    lmdb::txn txn = lmdb::txn::begin(env);
+    for (auto &lease : leases) {
+      if (lease->next != lease->end)
+        allocator.IdFree(txn, lease->next, lease->end - lease->next);
+      lmdb::val key(&lease->id, sizeof(object_id_t));
+      dbi.del(txn, key);
+    }
+    txn.commit();
+  } catch (const lmdb::error &e) {
+    std::cout << e.what();
+  }
+}
+
+//
+// Allocate an ID from the lease of the calling thread
+//
+// A new lease is only taken when the current one runs out, so most calls just
+// bump the thread's next ID.
+//
+optional<object_id_t> IdLeaseCache::IdAllocate() {
+  if (lease_slots_pruned != destroyed.load(std::memory_order_acquire))
+    PruneSlots();
+  Lease *lease = nullptr;
+  for (auto &slot : lease_slots) {
+    if (slot.first == serial) {
+      lease = slot.second;
+      break;
+    }
+  }
+  if (!lease || lease->next == lease->end) {
+    lease = AcquireLease(lease);
+    if (!lease)
+      return {};
+  } else if (lease->next == lease->limit) {
+    RaiseLimit(lease);
+  }
+  return lease->next++;
+}
+
+//
+// Drop the slots of the calling thread for caches destroyed since
+//
+// Serial numbers are never reused, so a stale slot is never matched, but it
+// would be kept for as long as the thread lives.
+//
+void IdLeaseCache::PruneSlots() {
+  std::lock_guard<std::mutex> lock(live_mutex);
+  lease_slots_pruned = destroyed.load(std::memory_order_acquire);
+  lease_slots.erase(
+      std::remove_if(lease_slots.begin(), lease_slots.end(),
+                     [](const std::pair<uint64_t, Lease *> &slot) {
+                       return !live_serials.count(slot.first);
+                     }),
+      lease_slots.end());
+}
+
+//
+// Lease a new extent for the calling thread
+//
+// The record of the exhausted lease #lease is replaced by the new one in the
+// same transaction that takes the extent from the allocator.
+//
+IdLeaseCache::Lease *IdLeaseCache::AcquireLease(Lease *lease) {
+  lmdb::txn txn = lmdb::txn::begin(env);
+  auto r = allocator.IdAllocate(txn, lease_size);
+  if (!r)
+    return nullptr;
+  if (lease) {
+    lmdb::val key(&lease->id, sizeof(object_id_t));
+    dbi.del(txn, key);
+  }
+  LeaseRecord record{r->second, r->first + std::min(r->second, limit_step)};
+  lmdb::val key(&r->first, sizeof(object_id_t));
+  lmdb::val data(&record, sizeof(LeaseRecord));
+  dbi.put(txn, key, data);
+  txn.commit();
+
+  if (!lease) {
+    std::lock_guard<std::mutex> lock(mutex);
+    leases.emplace_back(new Lease);
+    lease = leases.back().get();
+    lease_slots.emplace_back(serial, lease);
+  }
+  lease->id = lease->next = r->first;
+  lease->limit = record.limit;
+  lease->end = r->first + r->second;
+  return lease;
+}
+
+//
+// Move the high-water mark of #lease up
+//
+// The mark is moved before any ID at or past it is handed out, so it never
+// falls behind the IDs in use. With the default step the mark is the end of the
+// lease from the start, and this is never called.
+//
+void IdLeaseCache::RaiseLimit(Lease *lease) {
+  LeaseRecord record{lease->end - lease->id,
+                     lease->limit +
+                         std::min(lease->end - lease->limit, limit_step)};
+  lmdb::txn txn = lmdb::txn::begin(env);
+  lmdb::val key(&lease->id, sizeof(object_id_t));
+  lmdb::val data(&record, sizeof(LeaseRecord));
+  dbi.put(txn, key, data);
+  txn.commit();
+  lease->limit = record.limit;
+}
+
+//
+// Recover the leases recorded in the database
+//
+// Any record found here belongs to an instance that did not shut down cleanly.
+// The IDs of a lease from its high-water mark on were never handed out, so they
+// are freed right away. We cannot tell which IDs below the mark were handed
+// out, so every one of them is either checked with #is_live or, lacking that,
+// kept allocated.
+//
+void IdLeaseCache::RecoverLeases(lmdb::txn &txn, const liveness_t &is_live) {
+  lmdb::val val_id, val_record;
+  lmdb::cursor cursor = lmdb::cursor::open(txn, dbi);
+  while (cursor.get(val_id, val_record, MDB_FIRST)) {
+    object_id_t id = *val_id.data<object_id_t>();
+    LeaseRecord record{*val_record.data<object_id_t>(), 0};
+    record.limit = id + record.length;
+    if (val_record.size() == sizeof(LeaseRecord))
+      std::memcpy(&record, val_record.data(), sizeof(LeaseRecord));
+    object_id_t end = record.limit;
+    cursor.del();
+    if (end != id + record.length)
+      allocator.IdFree(txn, end, id + record.length - end);
+    if (!is_live)
+      continue;
+
+    // Free every run of IDs that never made it into use
+    object_id_t run = id;
+    for (object_id_t i = id; i != end; ++i) {
+      if (!is_live(txn, i))
+        continue;
+      if (run != i)
+        allocator.IdFree(txn, run, i - run);
+      run = i + 1;
+    }
+    if (run != end)
+      allocator.IdFree(txn, run, end - run);
+  }
+}
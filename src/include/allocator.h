@@ -4,6 +4,15 @@
 #include "lmdbxx/lmdb++.h"
 #include "optional.hpp"
 
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "free_map_snapshot.h"
+#include "id_traits.h"
+
 using std::experimental::optional;
 
 //
@@ -11,25 +20,341 @@ using std::experimental::optional;
 //
 typedef uint64_t object_id_t;
 
+//
+// Extent of ids, as its starting ID and length
+//
+template <typename Id> using basic_id_extent_t = std::pair<Id, Id>;
+typedef basic_id_extent_t<object_id_t> id_extent_t;
+
+//
+// Policy for choosing the free extent to allocate from
+//
+enum class AllocationPolicy {
+  // The extent with the lowest ID
+  FirstFit,
+  // The shortest extent long enough for the request
+  BestFit,
+  // The extent at or after the end of the previous allocation, wrapping around
+  // to the first extent past the last one
+  NextFit,
+};
+
+//
+// Representation of the free IDs
+//
+enum class AllocatorBackend {
+  // Every run of free IDs is an extent
+  Extent,
+  // Regions of IDs that are partially used are bitmaps, and only wholly free
+  // regions are extents
+  // The IDs free in the bitmaps are freed as extents or blocks when the
+  // allocator is opened with another backend.
+  Bitmap,
+  // Free IDs are blocks of a power of two IDs aligned to their length, in a
+  // free list per order. Allocating splits a block in halves down to the
+  // length asked for, and freeing coalesces a block with its buddy.
+  // Suited to allocating and freeing power-of-two ranges. The free extents are
+  // turned into blocks when the allocator is opened with this backend, and
+  // back when it is opened with another one.
+  Buddy,
+};
+
+//
+// Options of an allocator instance
+//
+template <typename Id> struct BasicAllocatorOptions {
+  // Policy for choosing the free extent to allocate from
+  AllocationPolicy policy = AllocationPolicy::FirstFit;
+  // Representation of the free IDs
+  AllocatorBackend backend = AllocatorBackend::Extent;
+  // Append freed IDs to a log, to be merged into the free IDs later by
+  // CompactFreeLog(), instead of merging them right away
+  bool deferred_free = false;
+  // Range of IDs managed by the allocator, as its first ID and number of IDs
+  // It only takes effect when the allocator is created in the environment,
+  // which records it. It may not go past the largest ID.
+  Id first_id = 0;
+  Id id_count = IdTraits<Id>::Max();
+  // Make allocation decisions against an in-memory mirror of the free extents,
+  // writing only the resulting changes to the database
+  // Not supported by the buddy backend.
+  bool mirror = false;
+  // Pack runs of free extents into delta-encoded blocks, shrinking the free
+  // extent database of a fragmented allocator
+  // The free extents in the environment are converted when the allocator is
+  // opened with another setting. Packed extents cannot be mirrored, and best
+  // fit only picks the best fitting block. Not supported by the buddy backend.
+  bool packed_extents = false;
+  // Keep the last free extent out of the free extent database while no other
+  // IDs are free, so that allocating from it only moves its start, the
+  // high-water mark, up
+  // Only supported by the extent backend.
+  bool bump_tail = false;
+};
+typedef BasicAllocatorOptions<object_id_t> AllocatorOptions;
+
+//
+// Extent representing a range of free ID
+//
+template <typename Id> struct BasicFreeIdExtent {
+  // Starting ID that is free
+  Id id;
+  // Length of the extent
+  Id length;
+};
+typedef BasicFreeIdExtent<object_id_t> FreeIdExtent;
+
+//
+// Statistics of the free IDs
+//
+template <typename Id> struct BasicAllocatorStats {
+  // Number of free IDs
+  Id free_ids;
+  // Number of free extents
+  uint64_t extents;
+  // Length of the longest free extent
+  Id largest_extent;
+  // Number of bitmaps of the bitmap backend
+  uint64_t bitmaps;
+  // Number of free extents by length, bucket i counting the extents of length
+  // in [2^i, 2^(i+1))
+  uint64_t histogram[sizeof(Id) * 8];
+};
+typedef BasicAllocatorStats<object_id_t> AllocatorStats;
+
+template <typename Id> struct ExtentCursor;
+template <typename Id> struct FreeExtentMirror;
+struct IdBitmap;
+
 //
 // Allocator interface
 //
-struct Allocator {
+// The allocator is a template over the type of ID, instantiated for 32, 64 and,
+// where the compiler has it, 128-bit IDs. The width of the IDs is recorded in
+// the environment, and an allocator of another width refuses to open it.
+//
+template <typename Id> struct BasicAllocator {
+  // Types of the ID width
+  typedef Id object_id_t;
+  typedef basic_id_extent_t<Id> id_extent_t;
+  typedef BasicAllocatorOptions<Id> AllocatorOptions;
+  typedef BasicFreeIdExtent<Id> FreeIdExtent;
+  typedef BasicAllocatorStats<Id> AllocatorStats;
+
   // Open/create the allocator in the environment
-  Allocator(lmdb::env &env);
+  BasicAllocator(lmdb::env &env,
+                 const AllocatorOptions &options = AllocatorOptions());
   // Close the allocator
-  ~Allocator() noexcept;
+  ~BasicAllocator() noexcept;
 
   // Allocate an ID
-  optional<std::pair<object_id_t, object_id_t>> IdAllocate(lmdb::txn &txn,
-                                                           object_id_t len);
+  optional<id_extent_t> IdAllocate(lmdb::txn &txn, object_id_t len);
+  // Allocate an ID as close to #hint as possible
+  optional<id_extent_t> IdAllocateNear(lmdb::txn &txn, object_id_t hint,
+                                       object_id_t len);
+  // Allocate #len IDs starting at a multiple of #align
+  // If no free extent holds such IDs, nothing is allocated.
+  optional<id_extent_t> IdAllocateAligned(lmdb::txn &txn, object_id_t len,
+                                          object_id_t align);
+  // Allocate IDs from the last free extent, leaving the free IDs before it
+  optional<id_extent_t> IdAllocateFresh(lmdb::txn &txn, object_id_t len);
+
+  // Allocate exactly #len IDs, possibly spread over multiple extents
+  // If there are not enough free IDs, nothing is allocated.
+  optional<std::vector<id_extent_t>> IdAllocateN(lmdb::txn &txn,
+                                                 object_id_t len);
+  // Allocate exactly #lens[i] IDs for every request i in one pass
+  // Either every request is satisfied or nothing is allocated.
+  optional<std::vector<std::vector<id_extent_t>>>
+  IdAllocateN(lmdb::txn &txn, const std::vector<object_id_t> &lens);
+
+  // Reserve the IDs of #ranges, such as IDs imported from elsewhere, so that
+  // they are never allocated
+  // The free IDs of the ranges are taken whatever the others, and the runs of
+  // IDs that were already allocated are returned, sorted by ID. The whole free
+  // log is merged first, in #txn.
+  std::vector<id_extent_t> IdReserveRanges(lmdb::txn &txn,
+                                           std::vector<id_extent_t> ranges);
 
   // Free an ID
   void IdFree(lmdb::txn &txn, object_id_t id, object_id_t len);
+  // Free a batch of extents in one pass
+  void IdFreeBatch(lmdb::txn &txn, std::vector<id_extent_t> extents);
+
+  // Merge up to #max_entries of the oldest deferred frees, or all of them if
+  // #max_entries is 0, returning the number merged
+  size_t CompactFreeLog(lmdb::txn &txn, size_t max_entries = 0);
+
+  // Check if #id is allocated
+  // #txn may be read-only. IDs freed to the free log count as free.
+  bool IsAllocated(lmdb::txn &txn, object_id_t id);
+  // Check if each of #ids, sorted in ascending order, is allocated
+  // #txn may be read-only. IDs freed to the free log count as free.
+  std::vector<bool> AreAllocated(lmdb::txn &txn,
+                                 const std::vector<object_id_t> &ids);
+
+  // Get the statistics of the free IDs
+  // #txn may be read-only.
+  AllocatorStats Stats(lmdb::txn &txn);
+
+  // Get the version of the free IDs as recorded in snapshots
+  // #txn may be read-only.
+  FreeMapSnapshotVersion SnapshotVersion(lmdb::txn &txn);
+  // Write the free IDs to a snapshot file at #path, replacing it atomically
+  // #txn may be read-only. Failing to write the file throws std::system_error.
+  void PublishSnapshot(lmdb::txn &txn, const std::string &path);
+
+  // Migrate the free extents in the environment to the current layout
+  // No allocator may be open on the environment. If there is nothing to
+  // migrate, false is returned.
+  static bool Migrate(lmdb::env &env);
+  // Rebuild the free IDs in #txn as the complement of the IDs keyed in
+  // #live_dbi and of #live_ids within the range of IDs the allocator was
+  // created with
+  // The range of #options is taken for allocators created before the range
+  // was recorded. #live_dbi must be keyed by ID as the allocator databases
+  // are. No allocator or lease cache may be open on the environment, and the
+  // leases left behind are dropped. The number of free extents is returned.
+  static uint64_t RebuildFromLiveIds(lmdb::txn &txn, lmdb::dbi &live_dbi,
+                                     std::vector<object_id_t> live_ids,
+                                     const AllocatorOptions &options =
+                                         AllocatorOptions());
 
 private:
+  // Prepare for changing the free extents in #txn
+  void BeginUpdate(lmdb::txn &txn);
+  // Finish changing the free extents in #txn
+  void EndUpdate(lmdb::txn &txn);
+  // Open a cursor over the free extents
+  std::unique_ptr<ExtentCursor<Id>> OpenCursor(lmdb::txn &txn);
+  // Open a cursor over the free extents in the database, bypassing the mirror
+  std::unique_ptr<ExtentCursor<Id>> OpenDbCursor(lmdb::txn &txn);
+  // Position #cursor at the extent to allocate #len IDs from
+  bool SeekExtent(lmdb::txn &txn, ExtentCursor<Id> &cursor, object_id_t len,
+                  FreeIdExtent &ext);
+  // Find the shortest extent holding at least #len IDs
+  bool FindBestFit(lmdb::txn &txn, object_id_t len, FreeIdExtent &ext);
+  // Find the longest extent
+  bool FindLongest(lmdb::txn &txn, FreeIdExtent &ext);
+  // Find the shortest extent holding #len IDs from a multiple of #align on
+  bool FindAlignedFit(lmdb::txn &txn, object_id_t len, object_id_t align,
+                      FreeIdExtent &ext);
+  // Position #cursor at the extent to allocate #len IDs at #id, a multiple of
+  // #align, from
+  bool SeekAlignedExtent(lmdb::txn &txn, ExtentCursor<Id> &cursor,
+                         object_id_t len, object_id_t align, FreeIdExtent &ext,
+                         object_id_t &id);
+  // Allocate up to #len IDs from the tail kept out of the free extents
+  bool BumpTail(lmdb::txn &txn, object_id_t len, id_extent_t &run);
+  // Move the last free extent out of the free extent database as the tail
+  void StashTail(lmdb::txn &txn);
+  // Take the #len IDs starting at #id out of the extent #ext at #cursor
+  void TakeExtent(lmdb::txn &txn, ExtentCursor<Id> &cursor,
+                  const FreeIdExtent &ext, object_id_t id, object_id_t len);
+  // Remove the extent #ext at #cursor from the free extent database
+  void EraseExtent(lmdb::txn &txn, ExtentCursor<Id> &cursor,
+                   const FreeIdExtent &ext);
+  // Insert the extent #ext into the free extent database
+  void InsertExtent(lmdb::txn &txn, ExtentCursor<Id> &cursor,
+                    const FreeIdExtent &ext);
+  // Replace the extent #old at #cursor with #ext
+  void ReplaceExtent(lmdb::txn &txn, ExtentCursor<Id> &cursor,
+                     const FreeIdExtent &old, const FreeIdExtent &ext);
+  // Free #len IDs starting at #id to the free extent database
+  void FreeExtent(lmdb::txn &txn, object_id_t id, object_id_t len);
+  // Free a batch of extents to the free extent database
+  void FreeBatch(lmdb::txn &txn, std::vector<id_extent_t> extents);
+  // Append the #len IDs starting at #id to the free log
+  void AppendFreeLog(lmdb::txn &txn, object_id_t id, object_id_t len);
+
+  // Allocate a run of up to #len IDs with the bitmap backend
+  optional<id_extent_t> AllocateRun(lmdb::txn &txn, object_id_t len);
+  // Allocate a run of up to #len IDs from #from on in the extent #ext
+  optional<id_extent_t> AllocateRunAt(lmdb::txn &txn,
+                                      std::unique_ptr<ExtentCursor<Id>> cursor,
+                                      const FreeIdExtent &ext, object_id_t from,
+                                      object_id_t len);
+  // Allocate a run of up to #len IDs from the first bitmap
+  optional<id_extent_t> AllocateFromBitmap(lmdb::txn &txn, object_id_t len);
+  // Allocate a run of up to #len IDs at or after #hint in its bitmap
+  optional<id_extent_t> AllocateNearInBitmap(lmdb::txn &txn, object_id_t hint,
+                                             object_id_t len);
+  // Free #len IDs starting at #id with the bitmap backend
+  void FreeRun(lmdb::txn &txn, object_id_t id, object_id_t len);
+  // Read the bitmap of #region
+  bool LoadBitmap(lmdb::txn &txn, object_id_t region, IdBitmap &bitmap);
+  // Write the bitmap of #region, removing it if no ID is free
+  void StoreBitmap(lmdb::txn &txn, object_id_t region, const IdBitmap &bitmap,
+                   uint64_t free_count);
+  // Move the free extents in #region into #bitmap
+  void MakeBitmap(lmdb::txn &txn, object_id_t region, IdBitmap &bitmap);
+  // Reserve the #len IDs starting at #id with the bitmap backend, appending
+  // the runs already allocated to #taken
+  void ReserveRun(lmdb::txn &txn, object_id_t id, object_id_t len,
+                  std::vector<id_extent_t> &taken);
+
+  // Allocate up to #len IDs from a block of at least #order with the buddy
+  // backend, or from a smaller block if #truncate
+  optional<id_extent_t> BuddyAllocate(lmdb::txn &txn, object_id_t len,
+                                      unsigned int order, bool truncate);
+  // Take up to #len IDs from the free block #block, split down to #order
+  id_extent_t TakeBlock(lmdb::txn &txn, const FreeIdExtent &block,
+                        unsigned int order, object_id_t len);
+  // Free #len IDs starting at #id with the buddy backend
+  void BuddyFree(lmdb::txn &txn, object_id_t id, object_id_t len);
+  // Reserve the #len IDs starting at #id with the buddy backend, appending the
+  // runs already allocated to #taken
+  void ReserveBlocks(lmdb::txn &txn, object_id_t id, object_id_t len,
+                     std::vector<id_extent_t> &taken);
+  // Add the block of #order at #id to the free blocks
+  void InsertBlock(lmdb::txn &txn, unsigned int order, object_id_t id);
+  // Remove the block of #order at #id from the free blocks, if it is free
+  bool EraseBlock(lmdb::txn &txn, unsigned int order, object_id_t id);
+
   // dbi of the allocator
   lmdb::dbi dbi;
+  // dbi of the free extents ordered by length, or of the longest extent of
+  // every block if the extents are packed
+  lmdb::dbi size_dbi;
+  // dbi of the allocator metadata
+  lmdb::dbi meta_dbi;
+  // dbi of the bitmaps of regions, keyed by region
+  lmdb::dbi bitmap_dbi;
+  // dbi of the deferred frees, keyed by sequence number
+  lmdb::dbi free_log_dbi;
+  // dbi of the free blocks of the buddy backend, keyed by order then ID
+  lmdb::dbi buddy_dbi;
+  // Policy for choosing the free extent to allocate from
+  AllocationPolicy policy;
+  // Representation of the free IDs
+  AllocatorBackend backend;
+  // Whether freed IDs are appended to the free log
+  bool deferred_free;
+  // Whether the free extents are packed into blocks
+  bool packed;
+  // Whether the last free extent is kept out of the database when alone
+  bool bump_tail;
+  // In-memory mirror of the free extents, if enabled
+  std::unique_ptr<FreeExtentMirror<Id>> mirror;
+  // Identifies this instance as the writer of a generation of free extents
+  uint64_t writer;
+  // Generation of the free extents seen by BeginUpdate()
+  uint64_t generation;
+  // Statistics of the free IDs, kept up to date from BeginUpdate() on
+  AllocatorStats stats;
+  // End of the latest allocation, where next fit resumes
+  object_id_t rotor;
+  // Whether the free extents were changed since BeginUpdate()
+  bool updated;
 };
 
+typedef BasicAllocator<object_id_t> Allocator;
+typedef BasicAllocator<uint32_t> Allocator32;
+extern template struct BasicAllocator<uint32_t>;
+extern template struct BasicAllocator<uint64_t>;
+#ifdef __SIZEOF_INT128__
+typedef BasicAllocator<uint128_t> Allocator128;
+extern template struct BasicAllocator<uint128_t>;
+#endif
+
 #endif // __ALLOCATOR_H__
\ No newline at end of file
@@ -0,0 +1,80 @@
+#ifndef __ALLOCATOR_SERVICE_H__
+#define __ALLOCATOR_SERVICE_H__
+
+#include <lmdbxx/lmdb++.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "allocator.h"
+
+//
+// Group-commit front end of an allocator
+//
+// Requests are queued from any thread and served by a single writer thread.
+// Once a request is queued, the writer waits up to #window for more to arrive,
+// then serves up to #max_batch of them in one write transaction and one commit.
+// The future of a request is made ready after the commit, so a result is never
+// seen before it is durable. If the transaction fails, the exception is
+// delivered to every request of the batch.
+//
+struct AllocatorService {
+  // Start serving requests against #allocator
+  AllocatorService(lmdb::env &env, Allocator &allocator,
+                   std::chrono::microseconds window =
+                       std::chrono::microseconds(1000),
+                   size_t max_batch = 1024);
+  // Serve the requests left in the queue and stop
+  ~AllocatorService() noexcept;
+
+  // Allocate an ID
+  std::future<optional<id_extent_t>> IdAllocate(object_id_t len);
+  // Free an ID
+  std::future<void> IdFree(object_id_t id, object_id_t len);
+
+private:
+  // Queued request
+  struct Request {
+    // Whether the request frees #id
+    bool free;
+    object_id_t id;
+    object_id_t len;
+    // Result of an allocation
+    std::promise<optional<id_extent_t>> allocated;
+    // Completion of a free
+    std::promise<void> freed;
+  };
+
+  // Body of the writer thread
+  void Run();
+  // Serve #batch in one write transaction
+  void Serve(std::vector<Request> &batch);
+  // Queue #request, waking the writer up
+  void Enqueue(Request &&request);
+
+  // The environment of the allocator
+  lmdb::env &env;
+  // The allocator serving the requests
+  Allocator &allocator;
+  // Time to wait for more requests after one is queued
+  std::chrono::microseconds window;
+  // Maximal number of requests per write transaction
+  size_t max_batch;
+  // Protects #queue and #stopping
+  std::mutex mutex;
+  // Signalled when a request is queued or the service is stopped
+  std::condition_variable cond;
+  // Requests not served yet
+  std::deque<Request> queue;
+  // Whether the service is being stopped
+  bool stopping;
+  // The writer thread
+  std::thread thread;
+};
+
+#endif // __ALLOCATOR_SERVICE_H__
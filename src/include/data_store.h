@@ -10,11 +10,16 @@
 //
 // Data Store interface
 //
-struct DataStore {
+// The data store is keyed by the IDs of an allocator of the same width.
+//
+template <typename Id>
+struct BasicDataStore {
+  typedef Id object_id_t;
+
   // Open/create the data store in the environment
-  DataStore(lmdb::env& env, Allocator& allocator);
+  BasicDataStore(lmdb::env& env, BasicAllocator<Id>& allocator);
   // Close the data store
-  ~DataStore() noexcept;
+  ~BasicDataStore() noexcept;
 
   // Check if object with #id exists
   // If #id does not exist, false is returned.
@@ -22,6 +27,21 @@ struct DataStore {
   // Get data with #id from data store
   // If #id does not exist, false is returned.
   bool GetData(lmdb::txn& txn, object_id_t id, std::string& data);
+  // Get data with #id from data store without copying it
+  // #data points into the database map, and is valid until #txn ends or
+  // changes the data store. If #id does not exist, false is returned.
+  bool GetData(lmdb::txn& txn, object_id_t id, lmdb::val& data);
+  // Call #visitor with a pointer to data with #id and its size
+  // The data is read in place, as by the overload above. If #id does not
+  // exist, #visitor is not called and false is returned.
+  template <typename Visitor>
+  bool GetData(lmdb::txn& txn, object_id_t id, Visitor&& visitor) {
+    lmdb::val data;
+    if (!GetData(txn, id, data))
+      return false;
+    visitor(data.data<const char>(), data.size());
+    return true;
+  }
   // Set data with #id in data store
   void SetData(lmdb::txn& txn,
                object_id_t id,
@@ -29,11 +49,29 @@ struct DataStore {
   // Delete data with #id from data store
   void DeleteData(lmdb::txn& txn, object_id_t id);
 
+  // Rebuild the free IDs of the allocator in the environment as the
+  // complement of the IDs in the data store and of the index entries in the
+  // index store, if any
+  // No allocator may be open on the environment. The number of free extents
+  // is returned.
+  static uint64_t RebuildAllocator(
+      lmdb::env& env,
+      const BasicAllocatorOptions<Id>& options = BasicAllocatorOptions<Id>());
+
  private:
   // dbi of the allocator
   lmdb::dbi dbi;
   // The allocator we are going to use
-  Allocator& allocator;
+  BasicAllocator<Id>& allocator;
 };
 
+typedef BasicDataStore<::object_id_t> DataStore;
+typedef BasicDataStore<uint32_t> DataStore32;
+extern template struct BasicDataStore<uint32_t>;
+extern template struct BasicDataStore<uint64_t>;
+#ifdef __SIZEOF_INT128__
+typedef BasicDataStore<uint128_t> DataStore128;
+extern template struct BasicDataStore<uint128_t>;
+#endif
+
 #endif  // __DATA_STORE_H__
\ No newline at end of file
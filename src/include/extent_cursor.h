@@ -0,0 +1,104 @@
+#ifndef __EXTENT_CURSOR_H__
+#define __EXTENT_CURSOR_H__
+
+#include "allocator.h"
+
+//
+// Key of #ext in the free extent database
+//
+// The free extents are keyed by their last ID, with their length as the data.
+// Allocating from the front of an extent or freeing IDs right before it keeps
+// its last ID, so the extent is updated in place.
+//
+template <typename Id>
+static inline Id ExtentKey(const BasicFreeIdExtent<Id> &ext) {
+  return ext.id + ext.length - 1;
+}
+
+//
+// Find the first ID #id of #ext that is a multiple of #align and followed by
+// at least #len IDs of #ext
+//
+template <typename Id>
+static inline bool AlignedWindow(const BasicFreeIdExtent<Id> &ext, Id len,
+                                 Id align, Id &id) {
+  Id skip = (align - ext.id % align) % align;
+  if (skip >= ext.length || ext.length - skip < len)
+    return false;
+  id = ext.id + skip;
+  return true;
+}
+
+//
+// Key of an extent in the database of free extents ordered by length
+//
+// The length and then the starting ID are stored big-endian, so that the keys
+// sort with memcmp() in the order of:
+//
+// 1. Length of the extent
+// 2. Starting ID of the extent
+//
+template <typename Id> struct SizeKey {
+  static constexpr int width = sizeof(Id);
+
+  explicit SizeKey(const BasicFreeIdExtent<Id> &ext) {
+    for (int i = 0; i < width; ++i) {
+      bytes[i] = ext.length >> (8 * (width - 1 - i));
+      bytes[width + i] = ext.id >> (8 * (width - 1 - i));
+    }
+  }
+
+  // Decode the extent from the key #key
+  static BasicFreeIdExtent<Id> Extent(const lmdb::val &key) {
+    const unsigned char *bytes = key.data<const unsigned char>();
+    BasicFreeIdExtent<Id> ext{0, 0};
+    for (int i = 0; i < width; ++i) {
+      ext.length = ext.length << 8 | bytes[i];
+      ext.id = ext.id << 8 | bytes[width + i];
+    }
+    return ext;
+  }
+
+  lmdb::val val() const { return lmdb::val(bytes, sizeof(bytes)); }
+
+  unsigned char bytes[2 * width];
+};
+
+//
+// Cursor over the free extents of an allocator
+//
+// Moving the cursor fills #ext with the extent it lands on, and fails if there
+// is no such extent. After Erase(), Next() and Prev() move from where the
+// removed extent was, as LMDB cursors do.
+//
+template <typename Id> struct ExtentCursor {
+  typedef BasicFreeIdExtent<Id> FreeIdExtent;
+
+  virtual ~ExtentCursor() noexcept {}
+
+  // Move to the first extent
+  virtual bool First(FreeIdExtent &ext) = 0;
+  // Move to the last extent
+  virtual bool Last(FreeIdExtent &ext) = 0;
+  // Move to the next extent
+  virtual bool Next(FreeIdExtent &ext) = 0;
+  // Move to the previous extent
+  virtual bool Prev(FreeIdExtent &ext) = 0;
+  // Move to the extent starting at #id
+  virtual bool Seek(Id id, FreeIdExtent &ext) = 0;
+  // Move to the first extent starting at or after #id
+  virtual bool SeekRange(Id id, FreeIdExtent &ext) = 0;
+  // Move to the first extent ending at or after #id, which holds #id if any
+  // does
+  virtual bool SeekEnd(Id id, FreeIdExtent &ext) = 0;
+
+  // Remove the extent at the cursor
+  virtual void Erase() = 0;
+  // Insert #ext and move to it
+  virtual void Insert(const FreeIdExtent &ext) = 0;
+  // Replace the extent #old at the cursor with #ext
+  // #ext must not overlap the neighbours of #old. The cursor stays at #ext.
+  virtual void Replace(const FreeIdExtent &old, const FreeIdExtent &ext) = 0;
+};
+
+#endif // __EXTENT_CURSOR_H__
@@ -0,0 +1,161 @@
+#ifndef __FREE_EXTENT_MIRROR_H__
+#define __FREE_EXTENT_MIRROR_H__
+
+#include <lmdbxx/lmdb++.h>
+
+#include <set>
+#include <utility>
+#include <vector>
+
+#include "allocator.h"
+#include "extent_cursor.h"
+
+//
+// Generation of the free extents
+//
+// Every write transaction changing the free extents stores a new generation in
+// the allocator metadata, tagged with the allocator instance that wrote it.
+//
+struct FreeExtentGeneration {
+  // Number of changes to the free extents
+  uint64_t generation;
+  // Allocator instance making the latest change
+  uint64_t writer;
+};
+
+//
+// In-memory mirror of the free extent database
+//
+// The extents are kept sorted by ID in a list of chunks, each a small sorted
+// array, so a lookup is a binary search over the chunks and then within one,
+// and an update only moves the extents of a single chunk. The extents are also
+// indexed by length for best fit.
+//
+// Every change is logged along with the transaction making it and the
+// generation the mirror had before. When the mirror is synced at the start of
+// an update, a generation in the database that differs from the mirror means
+// the transactions of the logged changes were aborted, and the changes are
+// undone. Changes made by transactions older than the one being synced with are
+// committed and dropped from the log.
+//
+template <typename Id> struct FreeExtentMirror {
+  typedef BasicFreeIdExtent<Id> FreeIdExtent;
+
+  // Position of an extent in the mirror
+  struct Position {
+    // Index of the chunk
+    size_t chunk;
+    // Index in the chunk
+    size_t index;
+  };
+
+  // Load the mirror from #cursor
+  void Load(ExtentCursor<Id> &cursor, const FreeExtentGeneration &generation);
+  // Sync the mirror with the database as seen by #txn
+  // If the mirror cannot be brought back to #generation, false is returned.
+  bool Sync(lmdb::txn &txn, const FreeExtentGeneration &generation);
+  // Record the generation written for the changes made since Sync()
+  void SetGeneration(const FreeExtentGeneration &generation);
+
+  // Move to the first/last extent
+  bool First(Position &pos) const;
+  bool Last(Position &pos) const;
+  // Move to the next/previous extent
+  // Prev() from the position past the last extent moves to the last one.
+  bool Next(Position &pos) const;
+  bool Prev(Position &pos) const;
+  // Move to the first extent starting at or after #id
+  bool LowerBound(Id id, Position &pos) const;
+  // Check if #pos is at an extent
+  bool Valid(const Position &pos) const;
+  // Get the extent at #pos
+  const FreeIdExtent &At(const Position &pos) const;
+
+  // Find the shortest extent holding at least #len IDs
+  bool BestFit(Id len, FreeIdExtent &ext) const;
+  // Find the shortest extent holding #len IDs from a multiple of #align on
+  bool AlignedFit(Id len, Id align, FreeIdExtent &ext) const;
+  // Find the longest extent
+  bool Longest(FreeIdExtent &ext) const;
+
+  // Insert #ext, returning its position
+  Position Insert(const FreeIdExtent &ext);
+  // Remove the extent at #pos, returning the position of the one following it
+  Position Erase(const Position &pos);
+  // Replace the extent at #pos with #ext, which keeps its position
+  void Replace(const Position &pos, const FreeIdExtent &ext);
+
+private:
+  // Change made to the mirror
+  struct Change {
+    // Transaction making the change
+    size_t txn_id;
+    // Generation of the mirror before the change
+    FreeExtentGeneration generation;
+    // Whether #ext was inserted or erased
+    bool inserted;
+    FreeIdExtent ext;
+  };
+
+  // Insert/remove without logging
+  Position DoInsert(const FreeIdExtent &ext);
+  Position DoErase(const Position &pos);
+
+  // Chunks of extents sorted by ID, none of them empty
+  std::vector<std::vector<FreeIdExtent>> chunks;
+  // Extents as (length, ID), for best fit
+  std::set<std::pair<Id, Id>> by_length;
+  // Changes not known to be committed yet
+  std::vector<Change> changes;
+  // Generation of the free extents the mirror holds
+  FreeExtentGeneration generation;
+  // Transaction the mirror was last synced with
+  size_t txn_id;
+};
+
+//
+// Cursor over the free extents in the mirror
+//
+// Lookups are served from the mirror, and changes are written through to the
+// free extent database.
+//
+template <typename Id> struct MirrorExtentCursor : ExtentCursor<Id> {
+  typedef BasicFreeIdExtent<Id> FreeIdExtent;
+
+  MirrorExtentCursor(FreeExtentMirror<Id> &mirror, lmdb::txn &txn,
+                     lmdb::dbi &dbi);
+
+  bool First(FreeIdExtent &ext) override;
+  bool Last(FreeIdExtent &ext) override;
+  bool Next(FreeIdExtent &ext) override;
+  bool Prev(FreeIdExtent &ext) override;
+  bool Seek(Id id, FreeIdExtent &ext) override;
+  bool SeekRange(Id id, FreeIdExtent &ext) override;
+  bool SeekEnd(Id id, FreeIdExtent &ext) override;
+  void Erase() override;
+  void Insert(const FreeIdExtent &ext) override;
+  void Replace(const FreeIdExtent &old, const FreeIdExtent &ext) override;
+
+private:
+  // Fill #ext from the current position
+  bool Get(bool found, FreeIdExtent &ext);
+
+  FreeExtentMirror<Id> &mirror;
+  lmdb::txn &txn;
+  lmdb::dbi &dbi;
+  // Current position
+  typename FreeExtentMirror<Id>::Position pos;
+  // Whether the extent at the current position was just erased
+  bool erased;
+};
+
+extern template struct FreeExtentMirror<uint32_t>;
+extern template struct FreeExtentMirror<uint64_t>;
+extern template struct MirrorExtentCursor<uint32_t>;
+extern template struct MirrorExtentCursor<uint64_t>;
+#ifdef __SIZEOF_INT128__
+extern template struct FreeExtentMirror<uint128_t>;
+extern template struct MirrorExtentCursor<uint128_t>;
+#endif
+
+#endif // __FREE_EXTENT_MIRROR_H__
@@ -0,0 +1,57 @@
+#ifndef __FREE_LOG_COMPACTOR_H__
+#define __FREE_LOG_COMPACTOR_H__
+
+#include <lmdbxx/lmdb++.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "allocator.h"
+
+//
+// Background compactor of the free log
+//
+// A thread wakes up every #interval and merges the deferred frees of the
+// allocator into its free extents, #batch_size log entries per write
+// transaction, until the log is empty.
+//
+struct FreeLogCompactor {
+  // Start compacting the free log of #allocator
+  FreeLogCompactor(lmdb::env &env, Allocator &allocator,
+                   std::chrono::milliseconds interval =
+                       std::chrono::milliseconds(100),
+                   size_t batch_size = 65536);
+  // Stop compacting
+  // Entries left in the log are merged by the next compaction.
+  ~FreeLogCompactor() noexcept;
+
+  // Wake the compactor up before its interval elapses
+  void Wake();
+
+private:
+  // Body of the compactor thread
+  void Run();
+
+  // The environment of the allocator
+  lmdb::env &env;
+  // The allocator whose free log is compacted
+  Allocator &allocator;
+  // Time between compactions
+  std::chrono::milliseconds interval;
+  // Number of log entries merged per write transaction
+  size_t batch_size;
+  // Protects #stopping and #woken
+  std::mutex mutex;
+  // Signalled to wake the thread up
+  std::condition_variable cond;
+  // Whether the compactor is being stopped
+  bool stopping;
+  // Whether the compactor was woken up
+  bool woken;
+  // The compactor thread
+  std::thread thread;
+};
+
+#endif // __FREE_LOG_COMPACTOR_H__
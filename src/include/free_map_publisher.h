@@ -0,0 +1,63 @@
+#ifndef __FREE_MAP_PUBLISHER_H__
+#define __FREE_MAP_PUBLISHER_H__
+
+#include <lmdbxx/lmdb++.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "allocator.h"
+
+//
+// Background publisher of snapshots of the free IDs
+//
+// A thread wakes up every #interval and, if the free IDs changed since the last
+// snapshot, publishes a new one at #path from a read-only transaction, so it
+// never holds the writer lock.
+//
+struct FreeMapPublisher {
+  // Start publishing snapshots of the free IDs of #allocator to #path
+  FreeMapPublisher(lmdb::env &env, Allocator &allocator,
+                   const std::string &path,
+                   std::chrono::milliseconds interval =
+                       std::chrono::milliseconds(1000));
+  // Stop publishing
+  // The snapshot last published is left in place.
+  ~FreeMapPublisher() noexcept;
+
+  // Wake the publisher up before its interval elapses
+  void Wake();
+
+private:
+  // Body of the publisher thread
+  void Run();
+  // Publish a snapshot if the free IDs changed since the last one
+  void Publish();
+
+  // The environment of the allocator
+  lmdb::env &env;
+  // The allocator whose free IDs are published
+  Allocator &allocator;
+  // Path of the snapshot file
+  std::string path;
+  // Time between snapshots
+  std::chrono::milliseconds interval;
+  // Version of the free IDs in the last snapshot, if #published
+  FreeMapSnapshotVersion version;
+  bool published;
+  // Protects #stopping and #woken
+  std::mutex mutex;
+  // Signalled to wake the thread up
+  std::condition_variable cond;
+  // Whether the publisher is being stopped
+  bool stopping;
+  // Whether the publisher was woken up
+  bool woken;
+  // The publisher thread
+  std::thread thread;
+};
+
+#endif // __FREE_MAP_PUBLISHER_H__
@@ -0,0 +1,154 @@
+#ifndef __FREE_MAP_SNAPSHOT_H__
+#define __FREE_MAP_SNAPSHOT_H__
+
+#include <sys/types.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+//
+// Flat snapshot of the free IDs of an allocator
+//
+// A snapshot file is a header followed by the free extents of the allocator,
+// sorted by ID, disjoint and maximally merged, as pairs of starting ID and
+// length of the width of the IDs, in host byte order. The extents start 64
+// bytes into the file, so they are aligned for vector loads.
+//
+// The free extents, bitmaps, buddy blocks, tail and free log are all flattened
+// into the snapshot. The file is written next to its path and renamed over it,
+// so a reader sees either the old or the new snapshot whole.
+//
+// Neither the snapshot nor its reader depend on LMDB. Processes that only look
+// up free IDs map the file and search it in memory.
+//
+
+// Magic number at the start of a snapshot file
+static constexpr char free_map_snapshot_magic[8] = {'I', 'D', 'F', 'R',
+                                                    'E', 'E', 'M', 'P'};
+// Version of the layout of snapshot files
+static constexpr uint32_t free_map_snapshot_format = 2;
+
+//
+// Version of the free IDs held by a snapshot
+//
+// The generation of the free extents is bumped by every change to them, but
+// not by frees deferred to the free log. Those are told apart by the sequence
+// number of the next entry of the log, which is persisted and never reused.
+//
+// Nor is the generation bumped by allocating from the tail, which only moves
+// its start up. Those are told apart by the start of the tail.
+//
+struct FreeMapSnapshotVersion {
+  // Generation of the free extents
+  uint64_t generation;
+  // Sequence number of the next entry of the free log
+  uint64_t log_sequence;
+  // Low 64 bits of the first ID of the tail, or 0 without a tail
+  // Within a generation the tail only moves up, so they repeat only after 2^64
+  // IDs were allocated from it.
+  uint64_t tail;
+
+  bool operator==(const FreeMapSnapshotVersion &other) const {
+    return generation == other.generation &&
+           log_sequence == other.log_sequence && tail == other.tail;
+  }
+  bool operator!=(const FreeMapSnapshotVersion &other) const {
+    return !(*this == other);
+  }
+};
+
+//
+// Header of a snapshot file
+//
+struct FreeMapSnapshotHeader {
+  // Set to free_map_snapshot_magic
+  char magic[8];
+  // Set to free_map_snapshot_format
+  uint32_t format;
+  // Width of the IDs in bytes
+  uint32_t id_width;
+  // Version of the free IDs
+  FreeMapSnapshotVersion version;
+  // Number of free extents following the header
+  uint64_t count;
+  // Pads the header to 64 bytes
+  unsigned char reserved[16];
+};
+static_assert(sizeof(FreeMapSnapshotHeader) == 64,
+              "the extents of a snapshot start 64 bytes into the file");
+
+//
+// Reader of a snapshot file
+//
+// The snapshot is mapped read-only and searched in place. A snapshot replaced
+// by the allocator stays mapped until Refresh() maps the new one.
+//
+template <typename Id> struct BasicFreeMapSnapshot {
+  //
+  // Free extent of a snapshot
+  //
+  struct Extent {
+    // Starting ID that is free
+    Id id;
+    // Length of the extent
+    Id length;
+  };
+
+  BasicFreeMapSnapshot();
+  ~BasicFreeMapSnapshot() noexcept;
+  BasicFreeMapSnapshot(const BasicFreeMapSnapshot &) = delete;
+  BasicFreeMapSnapshot &operator=(const BasicFreeMapSnapshot &) = delete;
+
+  // Map the snapshot at #path instead of the current one
+  // If the file is missing or is not a snapshot of IDs of this width, the
+  // current snapshot is kept and false is returned.
+  bool Open(const std::string &path);
+  // Map the snapshot at the path opened last again if the file was replaced
+  // Whether a new snapshot was mapped is returned.
+  bool Refresh();
+  // Unmap the snapshot
+  void Close();
+
+  // Version of the free IDs in the snapshot
+  FreeMapSnapshotVersion Version() const {
+    return header ? header->version : FreeMapSnapshotVersion{0, 0, 0};
+  }
+  // Free extents of the snapshot, sorted by ID
+  const Extent *Extents() const { return extents; }
+  size_t Size() const { return count; }
+
+  // Check if #id is free
+  bool IsFree(Id id) const;
+  // Find the first free IDs at or after #id
+  // The extent found is cut to start at #id if it holds it.
+  bool NextFree(Id id, Extent &ext) const;
+
+private:
+  // Find the first extent holding #id or starting after it
+  const Extent *Find(Id id) const;
+
+  // Path of the snapshot opened last
+  std::string path;
+  // Device and inode of the mapped file
+  dev_t device;
+  ino_t inode;
+  // The mapping, #length bytes long
+  void *map;
+  size_t length;
+  // Header and extents within the mapping
+  const FreeMapSnapshotHeader *header;
+  const Extent *extents;
+  size_t count;
+};
+
+typedef BasicFreeMapSnapshot<uint64_t> FreeMapSnapshot;
+typedef BasicFreeMapSnapshot<uint32_t> FreeMapSnapshot32;
+extern template struct BasicFreeMapSnapshot<uint32_t>;
+extern template struct BasicFreeMapSnapshot<uint64_t>;
+#ifdef __SIZEOF_INT128__
+typedef BasicFreeMapSnapshot<unsigned __int128> FreeMapSnapshot128;
+extern template struct BasicFreeMapSnapshot<unsigned __int128>;
+#endif
+
+#endif // __FREE_MAP_SNAPSHOT_H__
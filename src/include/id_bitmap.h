@@ -0,0 +1,45 @@
+#ifndef __ID_BITMAP_H__
+#define __ID_BITMAP_H__
+
+#include <cstddef>
+#include <cstdint>
+
+//
+// Bitmap of the free IDs in a region
+//
+// The leaf level is a 4 KiB bitmap with a bit set for every free ID. The
+// summary level has a bit set for every leaf word holding a free ID, so the
+// first free ID is found with two count-trailing-zeros scans at most 8 and 512
+// words apart, whatever the density of the region.
+//
+struct IdBitmap {
+  // Number of words of the leaf level
+  static constexpr size_t leaf_words = 512;
+  // Number of IDs covered by the bitmap
+  static constexpr uint64_t bits = leaf_words * 64;
+
+  // Mark every ID as used
+  void Clear();
+  // Check if the ID at #bit is free
+  bool IsFree(uint64_t bit) const {
+    return leaf[bit / 64] >> bit % 64 & 1;
+  }
+  // Find the first free ID
+  bool FindFree(uint64_t &bit) const;
+  // Find the first free ID at or after #from
+  bool FindFree(uint64_t from, uint64_t &bit) const;
+  // Mark up to #len consecutive free IDs starting at #bit as used
+  // The number of IDs marked is returned.
+  uint64_t Take(uint64_t bit, uint64_t len);
+  // Mark the #len IDs starting at #bit as free
+  void Release(uint64_t bit, uint64_t len);
+
+  // Number of free IDs
+  uint64_t free_count;
+  // Bit i set if leaf word i has a free ID
+  uint64_t summary[leaf_words / 64];
+  // Bit set for a free ID
+  uint64_t leaf[leaf_words];
+};
+
+#endif // __ID_BITMAP_H__
@@ -0,0 +1,92 @@
+#ifndef __ID_LEASE_CACHE_H__
+#define __ID_LEASE_CACHE_H__
+
+#include <lmdbxx/lmdb++.h>
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "allocator.h"
+
+//
+// ID lease cache
+//
+// The cache leases large extents from the allocator in a single write
+// transaction and hands out IDs from a per-thread range without taking any
+// transaction or lock. Every lease is recorded in the environment until its
+// unused remainder is given back, so leases outstanding at a crash can be
+// recovered on the next start.
+//
+// The record of a lease also holds a high-water mark no ID at or past which was
+// handed out. By default it is the end of the lease, so a lease is recorded
+// once and handing out its IDs takes no transaction. A smaller step moves the
+// mark up that many IDs at a time instead, each time in a write transaction of
+// its own. Recovery then only has to check the IDs below the mark and frees
+// the rest right away, at the cost of a writer lock and commit per step.
+//
+// Only one lease cache may be opened on an environment at a time, and the
+// calling thread must not hold a write transaction when it calls IdAllocate(),
+// since refilling a lease begins one.
+//
+struct IdLeaseCache {
+  // Predicate telling whether an ID handed out from a lease is in use.
+  // It is consulted when recovering the leases left behind by a crash.
+  typedef std::function<bool(lmdb::txn &, object_id_t)> liveness_t;
+
+  // Open/create the lease cache in the environment
+  // Leases left behind by an instance that did not shut down cleanly are
+  // recovered first: IDs in them past their high-water mark and those that
+  // #is_live reports as unused are returned to the allocator. Without #is_live
+  // the IDs below the mark are kept allocated.
+  // The high-water mark of a lease is moved up by #limit_step IDs at a time,
+  // or set to the end of the lease if it is 0.
+  IdLeaseCache(lmdb::env &env, Allocator &allocator,
+               object_id_t lease_size = 4096,
+               const liveness_t &is_live = liveness_t(),
+               object_id_t limit_step = 0);
+  // Return the unused remainder of every lease to the allocator
+  // No thread may call IdAllocate() concurrently with or after destruction.
+  ~IdLeaseCache() noexcept;
+
+  // Allocate an ID from the lease of the calling thread
+  optional<object_id_t> IdAllocate();
+
+private:
+  struct Lease;
+
+  // Lease a new extent for the calling thread, replacing #lease if any
+  Lease *AcquireLease(Lease *lease);
+  // Move the high-water mark of #lease up
+  void RaiseLimit(Lease *lease);
+  // Recover the leases recorded in the database
+  void RecoverLeases(lmdb::txn &txn, const liveness_t &is_live);
+  // Drop the slots of the calling thread for caches destroyed since
+  static void PruneSlots();
+
+  // Leases of the calling thread, by serial number of the cache
+  static thread_local std::vector<std::pair<uint64_t, Lease *>> lease_slots;
+  // Number of caches destroyed when the calling thread last pruned its slots
+  static thread_local uint64_t lease_slots_pruned;
+
+  // The environment leases are taken in
+  lmdb::env &env;
+  // The allocator we are going to lease from
+  Allocator &allocator;
+  // dbi of the lease records
+  lmdb::dbi dbi;
+  // Number of IDs to lease at a time
+  object_id_t lease_size;
+  // Number of IDs the high-water mark of a lease is moved up by at a time
+  object_id_t limit_step;
+  // Serial number identifying this cache in #lease_slots
+  uint64_t serial;
+  // Protects #leases
+  std::mutex mutex;
+  // Every lease handed to a thread
+  std::vector<std::unique_ptr<Lease>> leases;
+};
+
+#endif // __ID_LEASE_CACHE_H__
@@ -0,0 +1,83 @@
+#ifndef __ID_TRAITS_H__
+#define __ID_TRAITS_H__
+
+#include <lmdbxx/lmdb++.h>
+
+#include <cstdint>
+#include <cstring>
+
+#ifdef __SIZEOF_INT128__
+//
+// Type of 128-bit id
+//
+typedef unsigned __int128 uint128_t;
+#endif
+
+//
+// Encoding of an ID type in the databases
+//
+// IDs of up to 64 bits are stored in native byte order, so databases keyed by
+// them are MDB_INTEGERKEY. Wider IDs are stored big-endian, so that their keys
+// sort with memcmp().
+//
+template <typename Id> struct IdTraits {
+  // The largest ID
+  static constexpr Id Max() { return ~Id(0); }
+  // Flags of a database keyed by ID
+  static constexpr unsigned int KeyFlags() { return MDB_INTEGERKEY; }
+  // Index of the highest bit set in #id, which must not be 0
+  static unsigned int Log2(Id id) { return 63 - __builtin_clzll(id); }
+  // Store #id at #bytes, sizeof(Id) bytes long
+  static void Encode(Id id, void *bytes) {
+    std::memcpy(bytes, &id, sizeof(Id));
+  }
+  // Load the ID stored at #bytes
+  static Id Decode(const void *bytes) {
+    Id id;
+    std::memcpy(&id, bytes, sizeof(Id));
+    return id;
+  }
+};
+
+#ifdef __SIZEOF_INT128__
+template <> struct IdTraits<uint128_t> {
+  static constexpr uint128_t Max() { return ~uint128_t(0); }
+  static constexpr unsigned int KeyFlags() { return 0; }
+  static unsigned int Log2(uint128_t id) {
+    uint64_t high = id >> 64;
+    if (high)
+      return 127 - __builtin_clzll(high);
+    return 63 - __builtin_clzll(uint64_t(id));
+  }
+  static void Encode(uint128_t id, void *bytes) {
+    unsigned char *p = static_cast<unsigned char *>(bytes);
+    for (int i = 0; i < 16; ++i)
+      p[i] = id >> (120 - 8 * i);
+  }
+  static uint128_t Decode(const void *bytes) {
+    const unsigned char *p = static_cast<const unsigned char *>(bytes);
+    uint128_t id = 0;
+    for (int i = 0; i < 16; ++i)
+      id = id << 8 | p[i];
+    return id;
+  }
+};
+#endif
+
+//
+// Key or data holding an ID
+//
+template <typename Id> struct IdKey {
+  explicit IdKey(Id id) { IdTraits<Id>::Encode(id, bytes); }
+
+  // Decode the ID held by #val
+  static Id Get(const lmdb::val &val) {
+    return IdTraits<Id>::Decode(val.data());
+  }
+
+  lmdb::val val() const { return lmdb::val(bytes, sizeof(bytes)); }
+
+  alignas(Id) unsigned char bytes[sizeof(Id)];
+};
+
+#endif // __ID_TRAITS_H__
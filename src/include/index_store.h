@@ -4,6 +4,7 @@
 #include <lmdbxx/lmdb++.h>
 
 #include <string>
+#include <vector>
 
 #include "allocator.h"
 
@@ -23,6 +24,21 @@ struct IndexStore {
   // Get data with #index from index store
   // If #index does not exist, false is returned.
   bool GetIndex(lmdb::txn& txn, const std::string& index, std::string& data);
+  // Get data with #index from index store without copying it
+  // #data points into the database map, and is valid until #txn ends or
+  // changes the index store. If #index does not exist, false is returned.
+  bool GetIndex(lmdb::txn& txn, const std::string& index, lmdb::val& data);
+  // Call #visitor with a pointer to data with #index and its size
+  // The data is read in place, as by the overload above. If #index does not
+  // exist, #visitor is not called and false is returned.
+  template <typename Visitor>
+  bool GetIndex(lmdb::txn& txn, const std::string& index, Visitor&& visitor) {
+    lmdb::val data;
+    if (!GetIndex(txn, index, data))
+      return false;
+    visitor(data.data<const char>(), data.size());
+    return true;
+  }
 
   // Set data with #index in index store
   void SetIndex(lmdb::txn& txn,
@@ -32,6 +48,11 @@ struct IndexStore {
   // Delete data with #index from data store
   void DeleteIndex(lmdb::txn& txn, const std::string& index);
 
+  // Get the IDs of every index entry in the environment, sorted
+  // The entries take their IDs from the allocator too. If there is no index
+  // store, #ids is left empty.
+  static void EntryIds(lmdb::txn& txn, std::vector<object_id_t>& ids);
+
  private:
   // dbi of the allocator
   lmdb::dbi dbi;
@@ -0,0 +1,93 @@
+#ifndef __PACKED_EXTENTS_H__
+#define __PACKED_EXTENTS_H__
+
+#include <lmdbxx/lmdb++.h>
+
+#include <string>
+#include <vector>
+
+#include "allocator.h"
+#include "extent_cursor.h"
+
+//
+// Cursor over free extents packed into blocks
+//
+// Runs of consecutive free extents are packed into a single value of the free
+// extent database, keyed by the starting ID of the first extent. For every
+// extent, a block holds the gap since the end of the extent before it and the
+// length of the extent, both as varints. The gaps and lengths of a fragmented
+// allocator are small, so an extent takes a few bytes instead of an entry of
+// its own.
+//
+// The cursor decodes the block it is at. Changes are made to the decoded block
+// and written back, splitting a block that grows too large in halves and
+// merging a block that shrinks into the block following it.
+//
+// The size database holds the longest extent of every block rather than every
+// extent, keyed as by SizeKey with the key of the block as the ID.
+//
+template <typename Id> struct PackedExtentCursor : ExtentCursor<Id> {
+  typedef BasicFreeIdExtent<Id> FreeIdExtent;
+
+  PackedExtentCursor(lmdb::txn &txn, lmdb::dbi &dbi, lmdb::dbi &size_dbi);
+
+  bool First(FreeIdExtent &ext) override;
+  bool Last(FreeIdExtent &ext) override;
+  bool Next(FreeIdExtent &ext) override;
+  bool Prev(FreeIdExtent &ext) override;
+  bool Seek(Id id, FreeIdExtent &ext) override;
+  bool SeekRange(Id id, FreeIdExtent &ext) override;
+  bool SeekEnd(Id id, FreeIdExtent &ext) override;
+  void Erase() override;
+  void Insert(const FreeIdExtent &ext) override;
+  void Replace(const FreeIdExtent &old, const FreeIdExtent &ext) override;
+
+  // Find the longest extent
+  static bool Longest(lmdb::txn &txn, lmdb::dbi &dbi, lmdb::dbi &size_dbi,
+                      FreeIdExtent &ext);
+  // Find the shortest extent holding at least #len IDs in the block whose
+  // longest extent is the shortest to hold them
+  static bool BestFit(lmdb::txn &txn, lmdb::dbi &dbi, lmdb::dbi &size_dbi,
+                      Id len, FreeIdExtent &ext);
+  // Pack the extents of #from into the empty databases
+  static void Pack(lmdb::txn &txn, lmdb::dbi &dbi, lmdb::dbi &size_dbi,
+                   ExtentCursor<Id> &from);
+
+private:
+  // Make the block read by a cursor operation the current one
+  bool Load(bool found, const lmdb::val &key, const lmdb::val &data);
+  // Move to the block starting at or before #id, or to the first block
+  bool LoadAt(Id id);
+  // Move to the block following/preceding the current one
+  bool LoadNext();
+  bool LoadPrev();
+  // Fill #ext from the current position
+  bool Get(bool found, FreeIdExtent &ext);
+  // Write the current block back, splitting or merging it as needed
+  void Store();
+
+  lmdb::txn &txn;
+  lmdb::dbi &dbi;
+  lmdb::dbi &size_dbi;
+  lmdb::cursor cursor;
+  // Extents of the current block
+  std::vector<FreeIdExtent> block;
+  // Key and longest extent of the current block in the databases
+  Id key;
+  Id longest;
+  // Whether there is a current block, and whether it is in the databases
+  bool loaded;
+  bool stored;
+  // Index of the current extent in the block
+  size_t index;
+  // Whether the extent at the current position was just erased
+  bool erased;
+};
+
+extern template struct PackedExtentCursor<uint32_t>;
+extern template struct PackedExtentCursor<uint64_t>;
+#ifdef __SIZEOF_INT128__
+extern template struct PackedExtentCursor<uint128_t>;
+#endif
+
+#endif // __PACKED_EXTENTS_H__
@@ -0,0 +1,68 @@
+#ifndef __SHARDED_ALLOCATOR_H__
+#define __SHARDED_ALLOCATOR_H__
+
+#include <lmdbxx/lmdb++.h>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "allocator.h"
+
+//
+// Allocator sharded across environments
+//
+// The ID space is split by its high bits into as many ranges as there are
+// environments, each managed by an allocator of its own. As every environment
+// has its own write lock, writers allocating from different shards commit in
+// parallel.
+//
+// An allocation is made in one shard, picked round-robin or by the affinity of
+// the caller. A free goes to the shard owning the ID, given by its high bits.
+//
+struct ShardedAllocator {
+  // Open/create the allocator in the environments
+  // The number of environments must be a power of two.
+  ShardedAllocator(const std::vector<lmdb::env *> &envs,
+                   const AllocatorOptions &options = AllocatorOptions());
+  // Close the allocator
+  ~ShardedAllocator() noexcept;
+
+  // Get the number of shards
+  size_t ShardCount() const;
+  // Pick the next shard round-robin
+  size_t Shard();
+  // Pick the shard for #affinity, e.g. a thread or process number
+  size_t Shard(uint64_t affinity) const;
+  // Get the shard owning #id
+  size_t ShardOf(object_id_t id) const;
+  // Get the environment of #shard
+  lmdb::env &Env(size_t shard);
+
+  // Allocate an ID in #shard
+  // #txn must be a write transaction in the environment of #shard.
+  optional<id_extent_t> IdAllocate(lmdb::txn &txn, size_t shard,
+                                   object_id_t len);
+  // Allocate an ID in its own transaction
+  // The shards are tried round-robin until one has free IDs.
+  optional<id_extent_t> IdAllocate(object_id_t len);
+
+  // Free an ID
+  // #txn must be a write transaction in the environment of ShardOf(#id), and
+  // the IDs must not span shards.
+  void IdFree(lmdb::txn &txn, object_id_t id, object_id_t len);
+  // Free an ID in its own transaction
+  void IdFree(object_id_t id, object_id_t len);
+
+private:
+  // Environments of the shards
+  std::vector<lmdb::env *> envs;
+  // Allocators of the shards
+  std::vector<std::unique_ptr<Allocator>> shards;
+  // Number of high bits of an ID selecting its shard
+  unsigned shard_bits;
+  // Next shard to allocate from round-robin
+  std::atomic<size_t> next_shard;
+};
+
+#endif // __SHARDED_ALLOCATOR_H__
@@ -130,6 +130,15 @@ bool IndexStore::IndexExist(lmdb::txn &txn, const std::string &index) {
 
 bool IndexStore::GetIndex(lmdb::txn &txn, const std::string &index,
                           std::string &data) {
+  lmdb::val val_data;
+  if (!GetIndex(txn, index, val_data))
+    return false;
+  data.assign(val_data.data(), val_data.size());
+  return true;
+}
+
+bool IndexStore::GetIndex(lmdb::txn &txn, const std::string &index,
+                          lmdb::val &data) {
   uint64_t parent_id = max_parent_id;
   std::list<std::string> entry_list = ChopIndex(index);
   size_t i = 0, n = entry_list.size();
@@ -155,11 +164,8 @@ bool IndexStore::GetIndex(lmdb::txn &txn, const std::string &index,
   }
 
   // Retrieve data right at the current index
-  lmdb::val val_index, val_data;
-  if (!cursor.get(val_index, val_data, MDB_GET_CURRENT))
-    return false;
-  data.assign(val_data.data(), val_data.size());
-  return true;
+  lmdb::val val_index;
+  return cursor.get(val_index, data, MDB_GET_CURRENT);
 }
 
 void IndexStore::SetIndex(lmdb::txn &txn, const std::string &index,
@@ -271,4 +277,27 @@ void IndexStore::DeleteIndex(lmdb::txn &txn, const std::string &index) {
     }
     i++;
   }
+}
+
+//
+// Get the IDs of every index entry in the environment
+//
+// The entries are ordered by their parents and contents, not by their IDs, so
+// the IDs are gathered and sorted.
+//
+void IndexStore::EntryIds(lmdb::txn &txn, std::vector<object_id_t> &ids) {
+  ids.clear();
+  lmdb::dbi dbi(0);
+  try {
+    dbi = lmdb::dbi::open(txn, database_name, 0);
+  } catch (lmdb::not_found_error &) {
+    return;
+  }
+  dbi.set_compare(txn, IndexStoreCompare);
+  lmdb::val val_index, val_data;
+  lmdb::cursor cursor = lmdb::cursor::open(txn, dbi);
+  for (bool found = cursor.get(val_index, val_data, MDB_FIRST); found;
+       found = cursor.get(val_index, val_data, MDB_NEXT))
+    ids.push_back(val_index.data<IndexEntry>()->id);
+  std::sort(ids.begin(), ids.end());
 }
\ No newline at end of file
@@ -0,0 +1,31 @@
+#include <allocator.h>
+
+#include <cstdlib>
+#include <iostream>
+
+//
+// Migrate the allocator in the environment at the given path to the current
+// layout
+//
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    std::cerr << "Usage: " << argv[0] << " <environment>" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  lmdb::env env = lmdb::env::create();
+  try {
+    env.set_max_dbs(8);
+    env.set_mapsize(1ull * 1024 * 1024 * 1024 * 1024); // 1TiB max. mapsize
+    env.open(argv[1]);
+
+    if (Allocator::Migrate(env))
+      std::cout << "Migrated " << argv[1] << std::endl;
+    else
+      std::cout << "Nothing to migrate in " << argv[1] << std::endl;
+  } catch (const lmdb::error &e) {
+    std::cout << "Failure: " << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
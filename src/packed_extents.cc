@@ -0,0 +1,491 @@
+#include "packed_extents.h"
+
+#include <algorithm>
+#include <cassert>
+
+//
+// Maximal size of a block in bytes
+//
+// A block is split in halves when it grows past this, and merged into the
+// block following it when it shrinks below a quarter of this. Blocks are well
+// below the size at which LMDB moves a value to overflow pages.
+//
+static constexpr size_t block_size = 512;
+
+//
+// Append #value to #data as a varint
+//
+template <typename Id>
+static inline void PutVarint(std::string &data, Id value) {
+  while (value >= 0x80) {
+    data.push_back(static_cast<char>((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  data.push_back(static_cast<char>(value));
+}
+
+//
+// Read a varint at #p, moving #p past it
+//
+template <typename Id> static inline Id GetVarint(const unsigned char *&p) {
+  Id value = 0;
+  for (int shift = 0;; shift += 7) {
+    unsigned char byte = *p++;
+    value |= Id(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return value;
+  }
+}
+
+//
+// Append #ext, following the extent ending before #end, to #data
+//
+template <typename Id>
+static inline void EncodeExtent(std::string &data, Id end,
+                                const BasicFreeIdExtent<Id> &ext) {
+  PutVarint(data, ext.id - end);
+  PutVarint(data, ext.length);
+}
+
+//
+// Encode #block into #data
+//
+// The gap of the first extent is from the key of the block, so it is 0.
+//
+template <typename Id>
+static void EncodeBlock(const std::vector<BasicFreeIdExtent<Id>> &block,
+                        std::string &data) {
+  data.clear();
+  Id end = block.front().id;
+  for (const BasicFreeIdExtent<Id> &ext : block) {
+    EncodeExtent(data, end, ext);
+    end = ext.id + ext.length;
+  }
+}
+
+//
+// Decode the block at #key from #data into #block
+//
+template <typename Id>
+static void DecodeBlock(Id key, const lmdb::val &data,
+                        std::vector<BasicFreeIdExtent<Id>> &block) {
+  block.clear();
+  const unsigned char *p = data.data<const unsigned char>();
+  const unsigned char *end = p + data.size();
+  Id next = key;
+  while (p < end) {
+    BasicFreeIdExtent<Id> ext;
+    ext.id = next + GetVarint<Id>(p);
+    ext.length = GetVarint<Id>(p);
+    block.push_back(ext);
+    next = ext.id + ext.length;
+  }
+}
+
+//
+// Length of the longest extent of #block
+//
+template <typename Id>
+static Id LongestLength(const std::vector<BasicFreeIdExtent<Id>> &block) {
+  Id longest = 0;
+  for (const BasicFreeIdExtent<Id> &ext : block)
+    longest = std::max(longest, ext.length);
+  return longest;
+}
+
+//
+// Read the block at #key
+//
+template <typename Id>
+static void ReadBlock(lmdb::txn &txn, lmdb::dbi &dbi, Id key,
+                      std::vector<BasicFreeIdExtent<Id>> &block) {
+  IdKey<Id> block_key(key);
+  lmdb::val data;
+  bool found = dbi.get(txn, block_key.val(), data);
+  assert(found);
+  (void)found;
+  DecodeBlock(key, data, block);
+}
+
+//
+// Write #block, encoded as #data, along with its longest extent
+//
+template <typename Id>
+static void PutBlock(lmdb::txn &txn, lmdb::dbi &dbi, lmdb::dbi &size_dbi,
+                     const std::vector<BasicFreeIdExtent<Id>> &block,
+                     const std::string &data, unsigned int flags = 0) {
+  IdKey<Id> block_key(block.front().id);
+  lmdb::val key = block_key.val(), value(data.data(), data.size());
+  dbi.put(txn, key, value, flags);
+  SizeKey<Id> size_key(
+      BasicFreeIdExtent<Id>{block.front().id, LongestLength(block)});
+  lmdb::val empty;
+  size_dbi.put(txn, size_key.val(), empty);
+}
+
+//
+// Remove the block at #key, whose longest extent is #longest
+//
+template <typename Id>
+static void DelBlock(lmdb::txn &txn, lmdb::dbi &dbi, lmdb::dbi &size_dbi,
+                     Id key, Id longest) {
+  IdKey<Id> block_key(key);
+  SizeKey<Id> size_key(BasicFreeIdExtent<Id>{key, longest});
+  dbi.del(txn, block_key.val());
+  size_dbi.del(txn, size_key.val());
+}
+
+template <typename Id>
+PackedExtentCursor<Id>::PackedExtentCursor(lmdb::txn &txn, lmdb::dbi &dbi,
+                                           lmdb::dbi &size_dbi)
+    : txn(txn), dbi(dbi), size_dbi(size_dbi),
+      cursor(lmdb::cursor::open(txn, dbi)), key(0), longest(0), loaded(false),
+      stored(false), index(0), erased(false) {}
+
+template <typename Id>
+bool PackedExtentCursor<Id>::Load(bool found, const lmdb::val &key,
+                                  const lmdb::val &data) {
+  if (!found)
+    return false;
+  this->key = IdKey<Id>::Get(key);
+  DecodeBlock(this->key, data, block);
+  longest = LongestLength(block);
+  loaded = stored = true;
+  index = 0;
+  return true;
+}
+
+template <typename Id> bool PackedExtentCursor<Id>::LoadAt(Id id) {
+  IdKey<Id> id_key(id);
+  lmdb::val key = id_key.val(), data;
+  bool found = cursor.get(key, data, MDB_SET_RANGE);
+  if (found && IdKey<Id>::Get(key) == id)
+    return Load(true, key, data);
+  if (found ? cursor.get(key, data, MDB_PREV) : cursor.get(key, data, MDB_LAST))
+    return Load(true, key, data);
+  return Load(cursor.get(key, data, MDB_FIRST), key, data);
+}
+
+//
+// Move to the block following the current one
+//
+// The current block may have been removed, in which case the block following
+// its key is the one after it. If there is none, the cursor is left past the
+// end of the current block.
+//
+template <typename Id> bool PackedExtentCursor<Id>::LoadNext() {
+  IdKey<Id> block_key(key);
+  lmdb::val key = block_key.val(), data;
+  bool found = cursor.get(key, data, MDB_SET_RANGE);
+  if (found && IdKey<Id>::Get(key) == this->key)
+    found = cursor.get(key, data, MDB_NEXT);
+  if (!found) {
+    index = block.size();
+    return false;
+  }
+  return Load(true, key, data);
+}
+
+template <typename Id> bool PackedExtentCursor<Id>::LoadPrev() {
+  IdKey<Id> block_key(key);
+  lmdb::val key = block_key.val(), data;
+  bool found = cursor.get(key, data, MDB_SET_RANGE)
+                   ? cursor.get(key, data, MDB_PREV)
+                   : cursor.get(key, data, MDB_LAST);
+  if (!Load(found, key, data))
+    return false;
+  index = block.size() - 1;
+  return true;
+}
+
+template <typename Id>
+bool PackedExtentCursor<Id>::Get(bool found, FreeIdExtent &ext) {
+  erased = false;
+  if (found)
+    ext = block[index];
+  return found;
+}
+
+template <typename Id>
+bool PackedExtentCursor<Id>::First(FreeIdExtent &ext) {
+  lmdb::val key, data;
+  return Get(Load(cursor.get(key, data, MDB_FIRST), key, data), ext);
+}
+
+template <typename Id>
+bool PackedExtentCursor<Id>::Last(FreeIdExtent &ext) {
+  lmdb::val key, data;
+  if (!Load(cursor.get(key, data, MDB_LAST), key, data))
+    return Get(false, ext);
+  index = block.size() - 1;
+  return Get(true, ext);
+}
+
+template <typename Id>
+bool PackedExtentCursor<Id>::Next(FreeIdExtent &ext) {
+  if (!loaded)
+    return First(ext);
+  // The extent following an erased one is already at the current position
+  if (!erased && index < block.size())
+    ++index;
+  if (index < block.size())
+    return Get(true, ext);
+  return Get(LoadNext(), ext);
+}
+
+template <typename Id>
+bool PackedExtentCursor<Id>::Prev(FreeIdExtent &ext) {
+  if (!loaded)
+    return Last(ext);
+  if (index) {
+    --index;
+    return Get(true, ext);
+  }
+  return Get(LoadPrev(), ext);
+}
+
+template <typename Id>
+bool PackedExtentCursor<Id>::Seek(Id id, FreeIdExtent &ext) {
+  return SeekRange(id, ext) && ext.id == id;
+}
+
+template <typename Id>
+bool PackedExtentCursor<Id>::SeekRange(Id id, FreeIdExtent &ext) {
+  if (!LoadAt(id))
+    return Get(false, ext);
+  index = std::lower_bound(block.begin(), block.end(), id,
+                           [](const FreeIdExtent &e, Id id) {
+                             return e.id < id;
+                           }) -
+          block.begin();
+  if (index < block.size())
+    return Get(true, ext);
+  return Get(LoadNext(), ext);
+}
+
+template <typename Id>
+bool PackedExtentCursor<Id>::SeekEnd(Id id, FreeIdExtent &ext) {
+  if (!LoadAt(id))
+    return Get(false, ext);
+  index = std::lower_bound(block.begin(), block.end(), id,
+                           [](const FreeIdExtent &e, Id id) {
+                             return ExtentKey(e) < id;
+                           }) -
+          block.begin();
+  if (index < block.size())
+    return Get(true, ext);
+  return Get(LoadNext(), ext);
+}
+
+template <typename Id> void PackedExtentCursor<Id>::Erase() {
+  assert(index < block.size());
+  block.erase(block.begin() + index);
+  Store();
+  erased = true;
+}
+
+//
+// Insert #ext into the block it falls in
+//
+// An extent before every block goes into the first one, and an extent between
+// two blocks into the first of them. If there is no block, a new one is made.
+//
+template <typename Id>
+void PackedExtentCursor<Id>::Insert(const FreeIdExtent &ext) {
+  // The current block is used without a lookup if #ext falls inside it
+  if (!loaded || block.empty() || ext.id < block.front().id ||
+      ext.id > block.back().id) {
+    if (!LoadAt(ext.id)) {
+      block.clear();
+      key = ext.id;
+      loaded = true;
+      stored = false;
+    }
+  }
+  index = std::lower_bound(block.begin(), block.end(), ext.id,
+                           [](const FreeIdExtent &e, Id id) {
+                             return e.id < id;
+                           }) -
+          block.begin();
+  block.insert(block.begin() + index, ext);
+  Store();
+  erased = false;
+}
+
+template <typename Id>
+void PackedExtentCursor<Id>::Replace(const FreeIdExtent &old,
+                                     const FreeIdExtent &ext) {
+  assert(index < block.size() && block[index].id == old.id);
+  (void)old;
+  block[index] = ext;
+  Store();
+  erased = false;
+}
+
+//
+// Write the current block back
+//
+// A block that shrank takes in the block following it if both fit in one, and
+// a block that grew too large is split in halves, the cursor moving to the
+// half holding the current extent. A block that emptied is removed, and is
+// still current so that Next() and Prev() move from where it was.
+//
+template <typename Id> void PackedExtentCursor<Id>::Store() {
+  std::string data;
+  if (!block.empty())
+    EncodeBlock(block, data);
+
+  if (!block.empty() && data.size() < block_size / 4) {
+    // The block itself may still be stored under a key past its last extent
+    IdKey<Id> next_key(block.back().id + 1);
+    lmdb::val key = next_key.val(), value;
+    bool found = cursor.get(key, value, MDB_SET_RANGE);
+    if (found && stored && IdKey<Id>::Get(key) == this->key)
+      found = cursor.get(key, value, MDB_NEXT);
+    if (found) {
+      Id next = IdKey<Id>::Get(key);
+      std::vector<FreeIdExtent> following;
+      DecodeBlock(next, value, following);
+      std::string merged = data;
+      Id end = block.back().id + block.back().length;
+      for (const FreeIdExtent &ext : following) {
+        EncodeExtent(merged, end, ext);
+        end = ext.id + ext.length;
+      }
+      if (merged.size() <= block_size) {
+        DelBlock(txn, dbi, size_dbi, next, LongestLength(following));
+        block.insert(block.end(), following.begin(), following.end());
+        data.swap(merged);
+      }
+    }
+  }
+
+  std::vector<FreeIdExtent> upper;
+  std::string upper_data;
+  if (data.size() > block_size) {
+    size_t half = block.size() / 2;
+    upper.assign(block.begin() + half, block.end());
+    block.resize(half);
+    EncodeBlock(block, data);
+    EncodeBlock(upper, upper_data);
+  }
+
+  Id new_longest = LongestLength(block);
+  bool moved = block.empty() || block.front().id != key;
+  if (stored && (moved || new_longest != longest)) {
+    SizeKey<Id> size_key(FreeIdExtent{key, longest});
+    size_dbi.del(txn, size_key.val());
+  }
+  if (stored && moved) {
+    IdKey<Id> block_key(key);
+    dbi.del(txn, block_key.val());
+  }
+  if (block.empty()) {
+    stored = false;
+    return;
+  }
+  if (!stored || moved || new_longest != longest) {
+    PutBlock(txn, dbi, size_dbi, block, data);
+  } else {
+    IdKey<Id> block_key(key);
+    lmdb::val key = block_key.val(), value(data.data(), data.size());
+    dbi.put(txn, key, value);
+  }
+  key = block.front().id;
+  longest = new_longest;
+  stored = true;
+
+  if (!upper.empty()) {
+    PutBlock(txn, dbi, size_dbi, upper, upper_data);
+    if (index >= block.size()) {
+      index -= block.size();
+      block.swap(upper);
+      key = block.front().id;
+      longest = LongestLength(block);
+    }
+  }
+}
+
+//
+// Find the longest extent
+//
+// The block with the longest extent is the last one in the size database.
+//
+template <typename Id>
+bool PackedExtentCursor<Id>::Longest(lmdb::txn &txn, lmdb::dbi &dbi,
+                                     lmdb::dbi &size_dbi, FreeIdExtent &ext) {
+  lmdb::val key, data;
+  lmdb::cursor cursor = lmdb::cursor::open(txn, size_dbi);
+  if (!cursor.get(key, data, MDB_LAST))
+    return false;
+  FreeIdExtent summary = SizeKey<Id>::Extent(key);
+  std::vector<FreeIdExtent> block;
+  ReadBlock(txn, dbi, summary.id, block);
+  ext = *std::find_if(block.begin(), block.end(),
+                      [&summary](const FreeIdExtent &e) {
+                        return e.length == summary.length;
+                      });
+  return true;
+}
+
+//
+// Find the shortest extent holding at least #len IDs in the block whose
+// longest extent is the shortest to hold them
+//
+// This is only best fit among blocks: a block with a longer longest extent may
+// hold an extent fitting better.
+//
+template <typename Id>
+bool PackedExtentCursor<Id>::BestFit(lmdb::txn &txn, lmdb::dbi &dbi,
+                                     lmdb::dbi &size_dbi, Id len,
+                                     FreeIdExtent &ext) {
+  SizeKey<Id> size_key(FreeIdExtent{0, len});
+  lmdb::val key = size_key.val(), data;
+  lmdb::cursor cursor = lmdb::cursor::open(txn, size_dbi);
+  if (!cursor.get(key, data, MDB_SET_RANGE))
+    return false;
+  FreeIdExtent summary = SizeKey<Id>::Extent(key);
+  std::vector<FreeIdExtent> block;
+  ReadBlock(txn, dbi, summary.id, block);
+  ext = {0, 0};
+  for (const FreeIdExtent &e : block)
+    if (e.length >= len && (!ext.length || e.length < ext.length))
+      ext = e;
+  return true;
+}
+
+//
+// Pack the extents of #from into the empty databases
+//
+// The extents come in order, so every block is appended. Blocks are filled to
+// half their maximal size, leaving room for extents to be inserted.
+//
+template <typename Id>
+void PackedExtentCursor<Id>::Pack(lmdb::txn &txn, lmdb::dbi &dbi,
+                                  lmdb::dbi &size_dbi,
+                                  ExtentCursor<Id> &from) {
+  std::vector<FreeIdExtent> block;
+  std::string data;
+  Id end = 0;
+  FreeIdExtent ext;
+  for (bool found = from.First(ext); found; found = from.Next(ext)) {
+    if (block.empty())
+      end = ext.id;
+    block.push_back(ext);
+    EncodeExtent(data, end, ext);
+    end = ext.id + ext.length;
+    if (data.size() >= block_size / 2) {
+      PutBlock(txn, dbi, size_dbi, block, data, MDB_APPEND);
+      block.clear();
+      data.clear();
+    }
+  }
+  if (!block.empty())
+    PutBlock(txn, dbi, size_dbi, block, data, MDB_APPEND);
+}
+
+template struct PackedExtentCursor<uint32_t>;
+template struct PackedExtentCursor<uint64_t>;
+#ifdef __SIZEOF_INT128__
+template struct PackedExtentCursor<uint128_t>;
+#endif
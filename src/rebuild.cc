@@ -0,0 +1,31 @@
+#include <allocator.h>
+#include <data_store.h>
+
+#include <cstdlib>
+#include <iostream>
+
+//
+// Rebuild the free IDs of the allocator in the environment at the given path
+// from the IDs in its data store and index store
+//
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    std::cerr << "Usage: " << argv[0] << " <environment>" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  lmdb::env env = lmdb::env::create();
+  try {
+    env.set_max_dbs(16);
+    env.set_mapsize(1ull * 1024 * 1024 * 1024 * 1024); // 1TiB max. mapsize
+    env.open(argv[1]);
+
+    uint64_t extents = DataStore::RebuildAllocator(env);
+    std::cout << "Rebuilt " << argv[1] << " with " << extents
+              << " free extents" << std::endl;
+  } catch (const std::exception &e) {
+    std::cout << "Failure: " << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,102 @@
+#include "sharded_allocator.h"
+
+#include <cassert>
+#include <iostream>
+#include <stdexcept>
+
+//
+// Open/create the allocator in the environments
+//
+// Shard i manages the IDs whose high bits are i. The last shard stops short of
+// UINT64_MAX, which is not a valid ID.
+//
+ShardedAllocator::ShardedAllocator(const std::vector<lmdb::env *> &envs,
+                                   const AllocatorOptions &options) try
+    : envs(envs),
+      shard_bits(0),
+      next_shard(0) {
+  if (envs.empty() || (envs.size() & (envs.size() - 1)))
+    throw std::invalid_argument("number of shards must be a power of two");
+  while ((size_t(1) << shard_bits) < envs.size())
+    ++shard_bits;
+
+  for (size_t i = 0; i < envs.size(); ++i) {
+    AllocatorOptions shard_options = options;
+    if (shard_bits) {
+      unsigned shift = 64 - shard_bits;
+      shard_options.first_id = object_id_t(i) << shift;
+      shard_options.id_count = i + 1 < envs.size()
+                                   ? object_id_t(1) << shift
+                                   : UINT64_MAX - shard_options.first_id;
+    }
+    shards.emplace_back(new Allocator(*envs[i], shard_options));
+  }
+} catch (const std::exception &e) {
+  std::cout << e.what();
+  throw;
+}
+
+ShardedAllocator::~ShardedAllocator() noexcept {}
+
+size_t ShardedAllocator::ShardCount() const { return shards.size(); }
+
+size_t ShardedAllocator::Shard() {
+  return next_shard.fetch_add(1, std::memory_order_relaxed) % shards.size();
+}
+
+size_t ShardedAllocator::Shard(uint64_t affinity) const {
+  return affinity & (shards.size() - 1);
+}
+
+size_t ShardedAllocator::ShardOf(object_id_t id) const {
+  return shard_bits ? id >> (64 - shard_bits) : 0;
+}
+
+lmdb::env &ShardedAllocator::Env(size_t shard) { return *envs[shard]; }
+
+//
+// Allocate an ID in #shard
+//
+optional<id_extent_t> ShardedAllocator::IdAllocate(lmdb::txn &txn,
+                                                   size_t shard,
+                                                   object_id_t len) {
+  assert(mdb_txn_env(txn) == envs[shard]->handle());
+  return shards[shard]->IdAllocate(txn, len);
+}
+
+//
+// Allocate an ID in its own transaction
+//
+optional<id_extent_t> ShardedAllocator::IdAllocate(object_id_t len) {
+  size_t first = Shard();
+  for (size_t i = 0; i < shards.size(); ++i) {
+    size_t shard = (first + i) % shards.size();
+    lmdb::txn txn = lmdb::txn::begin(*envs[shard]);
+    optional<id_extent_t> r = shards[shard]->IdAllocate(txn, len);
+    if (r) {
+      txn.commit();
+      return r;
+    }
+  }
+  return {};
+}
+
+//
+// Free an ID
+//
+void ShardedAllocator::IdFree(lmdb::txn &txn, object_id_t id,
+                              object_id_t len) {
+  size_t shard = ShardOf(id);
+  assert(len && ShardOf(id + len - 1) == shard);
+  assert(mdb_txn_env(txn) == envs[shard]->handle());
+  shards[shard]->IdFree(txn, id, len);
+}
+
+//
+// Free an ID in its own transaction
+//
+void ShardedAllocator::IdFree(object_id_t id, object_id_t len) {
+  lmdb::txn txn = lmdb::txn::begin(Env(ShardOf(id)));
+  IdFree(txn, id, len);
+  txn.commit();
+}